@@ -1,23 +1,690 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define HEADER_SIZE 22
+#include "batch.h"
+#include "blockhash.h"
+#include "blockio.h"
+#include "echo.h"
+#include "wav.h"
+
+#define DEFAULT_BLOCK_SIZE 65536 // Samples per read/mix/write block
+
+/*
+ * Everything needed to process one file. In batch mode each worker thread owns one,
+ * so the echo ring and the block buffers are allocated once and reused for every file.
+ */
+typedef struct worker {
+    EchoTap taps[ECHO_MAX_TAPS];    // Delays in frames
+    int ntaps;
+    int feedback;
+    int saturate;
+    int block_size;
+    int use_stdio;
+    int incremental;            // Keep a sidecar of block hashes and only redo what changed
+    int async_depth;            // Blocks kept in flight by the queued I/O path, 0 to map instead
+
+    Echo echo;
+    unsigned char *block;       // block_size samples read on the stdio path
+    void *work;                 // block_size ints for unpacking 8, 24 and 32-bit PCM
+    int *tap_work;              // block_size ints per tap, unpacked delayed samples for lookback
+} Worker;
+
+/*
+ * Set up the echo ring for a file's sample format. Delays are in frames, so every channel
+ * echoes itself: the ring holds delay * channels interleaved samples.
+ * A single echo of 16-bit PCM is mixed by the SIMD kernels; several taps or feedback
+ * run on the multi-tap line, which takes 16-bit PCM unpacked to ints.
+ * lookback is set when the whole source is mapped, so a huge ring can be skipped (see mix_lookback).
+ * Returns 0 on success and -1 (after printing why) on failure.
+ */
+int start_echo(Worker *w, const WavInfo *info, int lookback) {
+    EchoTap taps[ECHO_MAX_TAPS];
+    for (int k = 0; k < w->ntaps; k++) {
+        if (w->taps[k].delay > 2147483647 / info->channels) {
+            fprintf(stderr, "Delay Too Large for %d Channels\n", info->channels);
+            return -1;
+        }
+        taps[k].delay = w->taps[k].delay * info->channels;
+        taps[k].volume_scale = w->taps[k].volume_scale;
+    }
+
+    int single = w->ntaps == 1 && w->feedback == 0;
+    int type = info->sample_type == WAV_S16 && single ? ECHO_S16
+             : info->sample_type == WAV_F32 ? ECHO_F32 : ECHO_S32;
+    if (echo_init_taps(&w->echo, type, info->bits_per_sample, taps, w->ntaps, w->feedback,
+                       w->saturate, lookback) == -1) {
+        fprintf(stderr, "Memory allocation failed for echo_buffer\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Mix samples of the file's format from in to out (in may equal out) through the echo ring.
+ * 16-bit (single echo) and aligned float samples are mixed where they lie; other PCM is
+ * unpacked into the work buffer and packed again afterwards. in == NULL mixes silence, which
+ * is how the echo tail is drained. Returns 0, or -1 if a spilled echo ring failed.
+ */
+int mix_samples(Worker *w, const WavInfo *info, const unsigned char *in, unsigned char *out,
+                 size_t samples) {
+    const int bytes = info->sample_bytes;
+    int direct = w->echo.type == ECHO_S16
+                 || (info->sample_type == WAV_F32 && ((size_t)in | (size_t)out) % sizeof(float) == 0);
+
+    for (size_t done = 0; done < samples; ) {
+        size_t n = samples - done < (size_t)w->block_size ? samples - done : (size_t)w->block_size;
+        const unsigned char *src = in == NULL ? NULL : in + done * bytes;
+        unsigned char *dest = out + done * bytes;
+
+        int mixed;
+        if (direct) {
+            mixed = echo_mix(&w->echo, src, dest, n);
+        } else if (info->sample_type == WAV_F32) {
+            if (src != NULL) {
+                memcpy(w->work, src, n * bytes);
+            }
+            mixed = echo_mix(&w->echo, src == NULL ? NULL : w->work, w->work, n);
+            memcpy(dest, w->work, n * bytes);
+        } else {
+            if (src != NULL) {
+                wav_decode(info, src, w->work, n);
+            }
+            mixed = echo_mix(&w->echo, src == NULL ? NULL : w->work, w->work, n);
+            wav_encode(info, w->work, dest, n);
+        }
+        if (mixed == -1) {
+            fprintf(stderr, "Could not read or write the spilled echo_buffer\n");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Unpack n samples at raw into work unless they can be mixed where they lie. NULL stays NULL.
+const void *unpack(const Worker *w, const WavInfo *info, const unsigned char *raw, void *work,
+                   size_t n, int direct) {
+    if (raw == NULL || direct) {
+        return raw;
+    }
+    if (info->sample_type == WAV_F32) {
+        memcpy(work, raw, n * info->sample_bytes);
+    } else {
+        wav_decode(info, raw, work, n);
+    }
+    return work;
+}
+
+/*
+ * Mix output samples from to to (the tail included, which runs to samples + delay) without an
+ * echo ring: each tap's echo is read back from the mapped source, delay samples behind. Used when
+ * the ring would be too big to keep in memory, and to redo part of an output incrementally.
+ * Blocks end wherever the source or a tap's copy of it starts or stops, so within a block each
+ * is either all samples or all silence.
+ */
+int mix_lookback(Worker *w, const WavInfo *info, const unsigned char *in, unsigned char *out,
+                 size_t samples, size_t from, size_t to) {
+    const int bytes = info->sample_bytes;
+    const Echo *echo = &w->echo;
+    const size_t total = samples + echo->delay;
+    int direct = echo->type == ECHO_S16
+                 || (info->sample_type == WAV_F32 && ((size_t)in | (size_t)out) % sizeof(float) == 0);
+
+    if (!direct && w->tap_work == NULL) {
+        w->tap_work = malloc((size_t)w->block_size * w->ntaps * sizeof(int));
+        if (w->tap_work == NULL) {
+            fprintf(stderr, "Memory allocation failed for block\n");
+            return -1;
+        }
+    }
+
+    for (size_t pos = from; pos < to; ) {
+        size_t n = to - pos < (size_t)w->block_size ? to - pos : (size_t)w->block_size;
+        if (pos < samples && samples - pos < n) {
+            n = samples - pos;
+        }
+        for (int k = 0; k < echo->ntaps; k++) {
+            size_t start = echo->taps[k].delay;
+            size_t end = samples + start;
+            size_t edge = pos < start ? start : pos < end ? end : total;
+            n = edge - pos < n ? edge - pos : n;
+        }
+
+        const void *delayed[ECHO_MAX_TAPS];
+        for (int k = 0; k < echo->ntaps; k++) {
+            size_t delay = echo->taps[k].delay;
+            const unsigned char *raw = pos >= delay && pos - delay < samples ? in + (pos - delay) * bytes : NULL;
+            delayed[k] = unpack(w, info, raw, w->tap_work + (size_t)k * w->block_size, n, direct);
+        }
+        const void *x = unpack(w, info, pos < samples ? in + pos * bytes : NULL, w->work, n, direct);
+
+        if (direct) {
+            echo_mix_lookback(echo, x, delayed, out + pos * bytes, n);
+        } else {
+            echo_mix_lookback(echo, x, delayed, w->work, n);
+            if (info->sample_type == WAV_F32) {
+                memcpy(out + pos * bytes, w->work, n * bytes);
+            } else {
+                wav_encode(info, w->work, out + pos * bytes, n);
+            }
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+// Hash of everything besides the source samples that decides the output.
+unsigned long long echo_params(const Worker *w, const WavInfo *info) {
+    int params[] = {info->format, info->sample_type, info->channels, (int)info->sample_rate,
+                    info->bits_per_sample, w->ntaps, w->feedback, w->saturate};
+    unsigned long long h = hash_bytes(params, sizeof(params), 0);
+    return hash_bytes(w->taps, w->ntaps * sizeof(EchoTap), h);
+}
+
+long long mtime_ns(const struct stat *st) {
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Incremental run over a destination left by an earlier one: recompute only the output a changed
+ * source block can reach, which is the block itself and the longest delay after it, and leave the
+ * rest of out as it is. If the source changed length, everything from the end of the shorter one
+ * on is redone. With feedback every echo depends on all the source before it, so any change
+ * means mixing the whole file again.
+ * Returns the number of samples recomputed, or -1 on failure.
+ */
+long long mix_changed(Worker *w, const WavInfo *info, const unsigned char *in, unsigned char *out,
+                      size_t samples, const BlockHashes *before, const BlockHashes *after) {
+    const size_t total = samples + w->echo.delay;
+    const size_t limit = before->samples == samples ? total
+                       : before->samples < samples ? before->samples : samples;
+
+    if (w->feedback != 0) {
+        if (before->samples == samples
+            && memcmp(before->hash, after->hash, after->nblocks * sizeof(unsigned long long)) == 0) {
+            return 0;
+        }
+        if (mix_samples(w, info, in, out, samples) == -1
+            || mix_samples(w, info, NULL, out + samples * info->sample_bytes, w->echo.delay) == -1) {
+            return -1;
+        }
+        return total;
+    }
+
+    size_t from = 0, to = 0;
+    long long recomputed = 0;
+    for (size_t j = 0; j <= after->nblocks; j++) {
+        size_t a, b;
+        if (j == after->nblocks) {
+            a = limit;
+            b = total;
+        } else if (j < before->nblocks && after->hash[j] == before->hash[j]) {
+            continue;
+        } else {
+            // Past limit is covered by the last range
+            a = j * after->block_samples;
+            b = (a + after->block_samples < samples ? a + after->block_samples : samples) + w->echo.delay;
+            a = a < limit ? a : limit;
+            b = b < limit ? b : limit;
+        }
+
+        // Changed blocks come in order, so a range only needs merging with the one before it
+        if (a > to) {
+            if (from < to && mix_lookback(w, info, in, out, samples, from, to) == -1) {
+                return -1;
+            }
+            recomputed += to - from;
+            from = a;
+        }
+        to = b > to ? b : to;
+    }
+    if (from < to && mix_lookback(w, info, in, out, samples, from, to) == -1) {
+        return -1;
+    }
+    return recomputed + (to - from);
+}
+
+/*
+ * Zero-copy path for regular files: the source is mapped read-only, the destination is
+ * sized up front and mapped shared, and samples are mixed straight from one map into the other.
+ * With a sidecar path (-i) the destination of the last run is kept and only what changed is
+ * mixed again (see mix_changed); the sidecar is then rewritten for the next run.
+ * Returns 0 on success, 1 if either file cannot be mapped (the caller falls back to stdio),
+ * and -1 on a hard error.
+ */
+int echo_mapped(Worker *w, int src_fd, int dest_fd, const char *sidecar) {
+    struct stat src_stat, dest_stat;
+
+    if (fstat(src_fd, &src_stat) == -1 || fstat(dest_fd, &dest_stat) == -1) {
+        return 1;
+    }
+    if (!S_ISREG(src_stat.st_mode) || !S_ISREG(dest_stat.st_mode) || src_stat.st_size == 0) {
+        return 1;
+    }
+
+    unsigned char *src = mmap(NULL, src_stat.st_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+    if (src == MAP_FAILED) {
+        return 1;
+    }
+    madvise(src, src_stat.st_size, MADV_SEQUENTIAL);
+
+    WavInfo info;
+    int err = wav_parse_buffer(src, src_stat.st_size, &info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+    }
+    if (err != 0 || start_echo(w, &info, 1) == -1) {
+        munmap(src, src_stat.st_size);
+        return -1;
+    }
+
+    // Whole frames only; the echo tail adds delay frames of every channel
+    size_t samples = info.data_size / info.block_align * info.channels;
+    size_t data_size = (samples + w->echo.delay) * info.sample_bytes;
+    size_t dest_size = WAV_HEADER_BYTES + data_size + (data_size & 1);
+
+    // The last run's output can be reused if it was made with the same settings and not touched since
+    BlockHashes before, after;
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    int reuse = 0;
+    if (sidecar != NULL) {
+        if (hashes_compute(&after, src + info.data_offset, samples, info.sample_bytes,
+                           (size_t)BLOCK_HASH_FRAMES * info.channels) == -1) {
+            fprintf(stderr, "Memory allocation failed for block hashes\n");
+            munmap(src, src_stat.st_size);
+            return -1;
+        }
+        after.params = echo_params(w, &info);
+        reuse = hashes_load(sidecar, &before) == 0 && before.params == after.params
+                && before.block_samples == after.block_samples
+                && before.dest_size == (size_t)dest_stat.st_size && before.dest_mtime == mtime_ns(&dest_stat);
+
+        // Only needed when the output shrinks; a fresh destination was truncated when it was opened
+        if ((size_t)dest_stat.st_size > dest_size && ftruncate(dest_fd, dest_size) == -1) {
+            perror("ftruncate");
+        }
+    }
+
+    // Reserve the blocks for the whole output; ftruncate still works where fallocate is unsupported
+    unsigned char *dest = MAP_FAILED;
+    if (posix_fallocate(dest_fd, 0, dest_size) == 0 || ftruncate(dest_fd, dest_size) == 0) {
+        dest = mmap(NULL, dest_size, PROT_READ | PROT_WRITE, MAP_SHARED, dest_fd, 0);
+    }
+    if (dest == MAP_FAILED) {
+        munmap(src, src_stat.st_size);
+        hashes_free(&before);
+        hashes_free(&after);
+        return 1;
+    }
+    if (!reuse) {
+        madvise(dest, dest_size, MADV_SEQUENTIAL);
+    }
+
+    wav_make_header(dest, &info, data_size);
+    unsigned char *out = dest + WAV_HEADER_BYTES;
+    int mixed;
+    if (reuse) {
+        long long recomputed = mix_changed(w, &info, src + info.data_offset, out, samples, &before, &after);
+        if (recomputed >= 0) {
+            printf("%.*s: %lld of %zu samples recomputed\n", (int)(strlen(sidecar) - strlen(".blocks")),
+                   sidecar, recomputed, samples + w->echo.delay);
+        }
+        mixed = recomputed == -1 ? -1 : 0;
+    } else if (w->echo.storage == ECHO_RING_NONE) {
+        mixed = mix_lookback(w, &info, src + info.data_offset, out, samples, 0, samples + w->echo.delay);
+    } else {
+        mixed = mix_samples(w, &info, src + info.data_offset, out, samples);
+
+        // Drain the echo tail straight into the mapping, oldest echo first
+        if (mixed == 0) {
+            mixed = mix_samples(w, &info, NULL, out + samples * info.sample_bytes, w->echo.delay);
+        }
+    }
+
+    munmap(src, src_stat.st_size);
+    if (munmap(dest, dest_size) == -1) {
+        perror("munmap");
+        mixed = -1;
+    }
+
+    // Record the destination as this run left it; the writes through the map have set its mtime
+    if (sidecar != NULL && mixed == 0 && fstat(dest_fd, &dest_stat) == 0) {
+        after.dest_size = dest_size;
+        after.dest_mtime = mtime_ns(&dest_stat);
+        mixed = hashes_save(sidecar, &after);
+    }
+    hashes_free(&before);
+    hashes_free(&after);
+    return mixed;
+}
+
+// pwrite until count bytes are written. Returns 0 on success, -1 on error.
+int full_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    while (count > 0) {
+        ssize_t r = pwrite(fd, buf, count, offset);
+        if (r <= 0) {
+            return -1;
+        }
+        buf = (const char *)buf + r;
+        count -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+// Where blockio_copy's blocks are mixed, in file order.
+typedef struct echo_blocks {
+    Worker *w;
+    const WavInfo *info;
+} EchoBlocks;
+
+int mix_block(void *state, unsigned char *block, size_t bytes) {
+    EchoBlocks *blocks = state;
+    return mix_samples(blocks->w, blocks->info, block, block, bytes / blocks->info->sample_bytes);
+}
+
+/*
+ * Queued asynchronous path for regular files (-A): reads and writes are issued ahead through
+ * io_uring (or POSIX AIO), async_depth blocks at a time, so mixing never waits on the disk.
+ * The echo tail is written after the last block. Prints the backend, queue depth and bandwidth.
+ * Returns 0 on success, 1 if either file is not a regular file (the caller falls back to stdio),
+ * and -1 on a hard error.
+ */
+int echo_async(Worker *w, int src_fd, int dest_fd) {
+    struct stat src_stat, dest_stat;
+    if (fstat(src_fd, &src_stat) == -1 || fstat(dest_fd, &dest_stat) == -1
+        || !S_ISREG(src_stat.st_mode) || !S_ISREG(dest_stat.st_mode)) {
+        return 1;
+    }
+
+    WavInfo info;
+    int err = wav_read_header_fd(src_fd, &info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+        return -1;
+    }
+    if (start_echo(w, &info, 0) == -1) {
+        return -1;
+    }
+
+    // Whole frames only; the pad byte (if any) comes from ftruncate's zero fill
+    size_t samples = info.data_size / info.block_align * info.channels;
+    size_t data_size = (samples + w->echo.delay) * info.sample_bytes;
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &info, data_size);
+    if (ftruncate(dest_fd, WAV_HEADER_BYTES + data_size + (data_size & 1)) == -1
+        || full_pwrite(dest_fd, header, WAV_HEADER_BYTES, 0) == -1) {
+        perror("addecho");
+        return -1;
+    }
+
+    EchoBlocks blocks = {w, &info};
+    BlockioStats stats;
+    if (blockio_copy(src_fd, info.data_offset, dest_fd, WAV_HEADER_BYTES, samples * info.sample_bytes,
+                     (size_t)w->block_size * info.sample_bytes, w->async_depth, mix_block, &blocks,
+                     &stats) == -1) {
+        return -1;
+    }
+
+    // Drain the echo tail, oldest echo first
+    size_t r;
+    for (size_t done = 0; done < (size_t)w->echo.delay; done += r) {
+        r = w->echo.delay - done < (size_t)w->block_size ? w->echo.delay - done : (size_t)w->block_size;
+        if (mix_samples(w, &info, NULL, w->block, r) == -1
+            || full_pwrite(dest_fd, w->block, r * info.sample_bytes,
+                           WAV_HEADER_BYTES + (samples + done) * info.sample_bytes) == -1) {
+            return -1;
+        }
+    }
+
+    printf("io: %s, queue depth %d (%.1f requests in flight on average), %.1f MB/s\n", stats.backend,
+           stats.depth, stats.average_in_flight, stats.seconds > 0 ? stats.bytes / 1e6 / stats.seconds : 0);
+    return 0;
+}
+
+// Regular files and block devices can be seeked back into to patch the header.
+int is_seekable(FILE *f) {
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+           && fseeko(f, 0, SEEK_CUR) == 0;
+}
+
+/*
+ * Fallback path for pipes and anything else that cannot be mapped:
+ * read a block of samples, mix the whole block against the echo ring, write it back out.
+ * Memory stays at one block plus the ring however long the stream is.
+ *
+ * A seekable destination gets a header with the expected sizes, which is rewritten
+ * with the real sizes once the last sample is out. A pipe cannot be patched, so it gets a
+ * streaming header (sizes WAV_SIZE_UNKNOWN) that readers treat as "until end of stream".
+ * Returns 0 on success and -1 on failure.
+ */
+int echo_stdio(Worker *w, FILE *orig, FILE *dest_file) {
+    WavInfo info;
+    int err = wav_read_header(orig, &info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+        return -1;
+    }
+    if (start_echo(w, &info, 0) == -1) {
+        return -1;
+    }
+
+    // Streaming encoders writing to a pipe leave the data size at 0 or WAV_SIZE_UNKNOWN
+    if (info.data_size == 0 && !is_seekable(orig)) {
+        info.data_size = WAV_SIZE_UNKNOWN;
+    }
+
+    // Whole frames only, unless the header does not say how much data follows
+    size_t remaining = (size_t)-1;
+    size_t data_size = WAV_SIZE_UNKNOWN;
+    if (info.data_size != WAV_SIZE_UNKNOWN) {
+        remaining = info.data_size / info.block_align * info.channels;
+        data_size = (remaining + w->echo.delay) * info.sample_bytes;
+    }
+
+    int seekable = is_seekable(dest_file);
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &info, seekable ? data_size : WAV_SIZE_UNKNOWN);
+    fwrite(header, WAV_HEADER_BYTES, 1, dest_file);
+
+    size_t written = 0;
+    size_t r;
+    while (remaining > 0) {
+        size_t want = remaining < (size_t)w->block_size ? remaining : (size_t)w->block_size;
+        if ((r = fread(w->block, info.sample_bytes, want, orig)) == 0) {
+            break;
+        }
+        if (mix_samples(w, &info, w->block, w->block, r) == -1) {
+            return -1;
+        }
+        fwrite(w->block, info.sample_bytes, r, dest_file);
+        remaining -= r;
+        written += r;
+    }
+
+    // Drain the echo tail, oldest echo first
+    for (size_t done = 0; done < (size_t)w->echo.delay; done += r) {
+        r = w->echo.delay - done < (size_t)w->block_size ? w->echo.delay - done : (size_t)w->block_size;
+        if (mix_samples(w, &info, NULL, w->block, r) == -1) {
+            return -1;
+        }
+        fwrite(w->block, info.sample_bytes, r, dest_file);
+    }
+    written += w->echo.delay;
+
+    // Chunks are word aligned, so an odd-sized data chunk gets a pad byte
+    if (written * info.sample_bytes % 2) {
+        fputc(0, dest_file);
+    }
+
+    // Deferred fix-up: now that the real size is known, patch it in if we can seek back
+    if (seekable && written * info.sample_bytes != data_size) {
+        wav_make_header(header, &info, written * info.sample_bytes);
+        if (fseeko(dest_file, 0, SEEK_SET) != 0
+            || fwrite(header, WAV_HEADER_BYTES, 1, dest_file) != 1
+            || fseeko(dest_file, 0, SEEK_END) != 0) {
+            perror("addecho: header fix-up");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Add echo to one file: map both files when we can, otherwise stream them through stdio.
+ * A path of "-" is standard input or output, so addecho can sit in a pipeline.
+ * Matches BatchFn. Returns 0 on success and 1 on failure.
+ */
+int addecho_file(void *worker, const char *src_path, const char *dest_path) {
+    Worker *w = worker;
+
+    int src_fd = strcmp(src_path, "-") == 0 ? dup(STDIN_FILENO) : open(src_path, O_RDONLY);
+    if (src_fd == -1) { //Checking if files were successfully opened.
+        fprintf(stderr, "Invalid File: %s\n", src_path);
+        return 1;
+    }
+    // An incremental run keeps the destination, next to which its sidecar lives
+    char *sidecar = NULL;
+    if (w->incremental && strcmp(dest_path, "-") != 0 && !w->use_stdio && w->async_depth == 0) {
+        sidecar = malloc(strlen(dest_path) + 8);
+        if (sidecar == NULL) {
+            fprintf(stderr, "Memory allocation failed for sidecar\n");
+            close(src_fd);
+            return 1;
+        }
+        sprintf(sidecar, "%s.blocks", dest_path);
+    }
+
+    int dest_fd = strcmp(dest_path, "-") == 0 ? dup(STDOUT_FILENO)
+                : open(dest_path, O_RDWR | O_CREAT | (sidecar == NULL ? O_TRUNC : 0), 0666);
+    if (dest_fd == -1) {
+        fprintf(stderr, "Invalid File: %s\n", dest_path);
+        close(src_fd);
+        free(sidecar);
+        return 1;
+    }
+
+    int result = w->use_stdio ? 1
+               : w->async_depth > 0 ? echo_async(w, src_fd, dest_fd) : echo_mapped(w, src_fd, dest_fd, sidecar);
+    if (result == 1 && sidecar != NULL) {
+        // Not mappable after all: start the destination over, and drop a sidecar that no longer fits it
+        if (ftruncate(dest_fd, 0) == -1) {
+            perror("ftruncate");
+        }
+        unlink(sidecar);
+    }
+    free(sidecar);
+    if (result == 1) {
+        FILE *orig = fdopen(src_fd, "rb");
+        FILE *dest_file = fdopen(dest_fd, "wb");
+        if (orig == NULL || dest_file == NULL) {
+            perror("fdopen");
+            exit(EXIT_FAILURE);
+        }
+
+        result = echo_stdio(w, orig, dest_file);
+        fclose(orig);
+        if (fclose(dest_file) != 0) {
+            perror("fclose");
+            result = -1;
+        }
+    } else {
+        close(src_fd);
+        close(dest_fd);
+    }
+
+    return result == 0 ? 0 : 1;
+}
+
+// Allocate a worker's block buffers. Returns NULL if memory runs out.
+Worker *new_worker(const EchoTap *taps, int ntaps, int feedback, int saturate, int block_size,
+                   int use_stdio, int incremental, int async_depth) {
+    Worker *w = calloc(1, sizeof(Worker));
+    if (w == NULL) {
+        return NULL;
+    }
+    memcpy(w->taps, taps, ntaps * sizeof(EchoTap));
+    w->ntaps = ntaps;
+    w->feedback = feedback;
+    w->saturate = saturate;
+    w->block_size = block_size;
+    w->use_stdio = use_stdio;
+    w->incremental = incremental;
+    w->async_depth = async_depth;
+
+    // Samples are at most 4 bytes, packed or unpacked
+    w->block = malloc((size_t)block_size * sizeof(int));
+    w->work = malloc((size_t)block_size * sizeof(int));
+    if (w->block == NULL || w->work == NULL) {
+        free(w->block);
+        free(w->work);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void free_worker(Worker *w) {
+    echo_free(&w->echo);
+    free(w->tap_work);
+    free(w->block);
+    free(w->work);
+    free(w);
+}
+
+// Print the echo settings, one value per tap.
+void print_settings(FILE *f, const EchoTap *taps, int ntaps, int feedback) {
+    fprintf(f, "delay:");
+    for (int k = 0; k < ntaps; k++) {
+        fprintf(f, " %d", taps[k].delay);
+    }
+    fprintf(f, "\nvolume_scale:");
+    for (int k = 0; k < ntaps; k++) {
+        fprintf(f, " %d", taps[k].volume_scale);
+    }
+    fprintf(f, "\n");
+    if (feedback != 0) {
+        fprintf(f, "feedback: %d\n", feedback);
+    }
+}
 
 int main(int argc, char **argv) {
     
     extern char *optarg;
     extern int optind;
 
-    int delay = 8000;
-    int volume_scale = 4;
+    // The i-th -d pairs up with the i-th -v; a tap missing either gets the default
+    int delays[ECHO_MAX_TAPS];
+    int volume_scales[ECHO_MAX_TAPS];
+    int ndelays = 0;
+    int nvolume_scales = 0;
+    int feedback = 0;
+    int block_size = DEFAULT_BLOCK_SIZE;
+    int saturate = 0;
+    int use_stdio = 0;
+    int incremental = 0;
+    int async_depth = 0;
+    char *batch_input = NULL;
+    char *out_dir = ".";
+    int workers = 1;
 
     int opt;
 
-    while ((opt = getopt(argc, argv, "d:v:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:v:f:b:sSiA:B:o:w:")) != -1) {
         char *err;
         switch (opt) {
             case 'd':
+                if (ndelays == ECHO_MAX_TAPS) {
+                    fprintf(stderr, "At Most %d Delays Can Be Given\n", ECHO_MAX_TAPS);
+                    exit(EXIT_FAILURE);
+                }
 
                 // Check for overflow and underflow
                 long tmp = strtol(optarg, &err, 10);
@@ -27,14 +694,19 @@ int main(int argc, char **argv) {
                 }
 
                 // Checks for invalid input, non-positive integers
-                delay = tmp;
-                if (delay != strtof(optarg, &err) || delay <= 0) {
+                delays[ndelays] = tmp;
+                if (delays[ndelays] != strtof(optarg, &err) || delays[ndelays] <= 0) {
                     fprintf(stderr, "Delay Parameter Must Contain a Positive Integer\n");
                     exit(EXIT_FAILURE);
                 }
+                ndelays++;
                 break;
 
             case 'v':
+                if (nvolume_scales == ECHO_MAX_TAPS) {
+                    fprintf(stderr, "At Most %d Volume Scales Can Be Given\n", ECHO_MAX_TAPS);
+                    exit(EXIT_FAILURE);
+                }
 
                 // Check for overflow and underflow
                 tmp = strtol(optarg, &err, 10);
@@ -44,118 +716,149 @@ int main(int argc, char **argv) {
                 }
 
                 // Checks for invalid input, non-positive integers
-                volume_scale = tmp;
-                if (volume_scale != strtof(optarg, &err) || volume_scale <= 0) {
+                volume_scales[nvolume_scales] = tmp;
+                if (volume_scales[nvolume_scales] != strtof(optarg, &err)
+                    || volume_scales[nvolume_scales] <= 0) {
                     fprintf(stderr, "Volume Parameter Must Contain a Positive Integer\n");
                     exit(EXIT_FAILURE);
                 }
+                nvolume_scales++;
                 break;
 
-            default:
-                fprintf(stderr, "Usage: %s [-d delay] [-v volume_scale] src_file dest_file\n",
-                           argv[0]);
-                   exit(EXIT_FAILURE);
+            case 'f':
+
+                // Check for overflow and underflow
+                tmp = strtol(optarg, &err, 10);
+                if (tmp > 2147483647 || tmp < -2147483648) {
+                    fprintf(stderr, "Feedback Parameter Must Be a 32-bit Integer\n");
+                    exit(EXIT_FAILURE);
                 }
-        }
 
-    // Checks for empty file parameters
-    if ((optind + 2) != argc) {
-        fprintf(stderr, "Empty File Parameter(s))\n");
-        exit(EXIT_FAILURE);
-    }
+                // Checks for invalid input, non-positive integers
+                feedback = tmp;
+                if (feedback != strtof(optarg, &err) || feedback <= 0) {
+                    fprintf(stderr, "Feedback Parameter Must Contain a Positive Integer\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
 
-    printf("delay: %d\n", delay);
-    printf("volume_scale: %d\n", volume_scale);
-    printf("source_file: %s\n", argv[optind]);
-    printf("dest_file: %s\n", argv[optind + 1]);
+            case 'b':
 
-    FILE *orig = fopen(argv[optind], "rb");
-    FILE *dest_file = fopen(argv[optind + 1], "wb");
+                // Check for overflow and underflow
+                tmp = strtol(optarg, &err, 10);
+                if (tmp > 2147483647 || tmp < -2147483648) {
+                    fprintf(stderr, "Block Size Must Be a 32-bit Integer\n");
+                    exit(EXIT_FAILURE);
+                }
 
-    if (orig == NULL || dest_file == NULL) { //Checking if files were successfully opened.
-        fprintf(stderr, "Invalid File\n");
-        return 1;
-    }
+                // Checks for invalid input, non-positive integers
+                block_size = tmp;
+                if (block_size != strtof(optarg, &err) || block_size <= 0) {
+                    fprintf(stderr, "Block Size Must Contain a Positive Integer\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
 
-    // Receive header information, and change bytes 4 and 40
-    short header[HEADER_SIZE];
-    unsigned int *sizeptr;
-    
-    fread(header, sizeof(short) * HEADER_SIZE, 1, orig);
+            case 's':
+                saturate = 1;
+                break;
 
-    sizeptr = (unsigned int *)(header + 2);
-    *sizeptr = *sizeptr + delay * 2;
+            case 'S':
+                use_stdio = 1;
+                break;
 
-    sizeptr = (unsigned int *)(header + 20);
-    *sizeptr = *sizeptr + delay * 2;
+            case 'i':
+                incremental = 1;
+                break;
 
-    fwrite(header, sizeof(short) * HEADER_SIZE, 1, dest_file);
-    
-    // Find echo buffer size + memory allocation
-    short *echo_buffer = (short*)malloc(delay * sizeof(short)); 
-    if (echo_buffer == NULL) {
-        fprintf(stderr, "Memory allocation failed for echo_buffer\n");
-        exit(EXIT_FAILURE);
-    }
+            case 'A':
+                async_depth = strtol(optarg, &err, 10);
+                if (*err != '\0' || async_depth <= 0 || async_depth > 64) {
+                    fprintf(stderr, "Queue Depth Must Be an Integer From 1 to 64\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
 
+            case 'B':
+                batch_input = optarg;
+                break;
 
-    short sample;
-    int r;
-    int samples = 0;
-    int counter = 0;
-    int echo_index = 0;
+            case 'o':
+                out_dir = optarg;
+                break;
 
-    // Write the same sample until sample[delay] is reached
-    // If delay > # of samples, then keep writing 0's until delay is reached
-    while (counter < delay) {
-        
-        r = fread(&sample, sizeof(short), 1, orig);
-        if (r == 0) {
-            sample = 0;
-            fwrite(&sample, sizeof(short), 1, dest_file);
-            samples--;
-        }
-        else {
-            fwrite(&sample, sizeof(short), 1, dest_file);
-            echo_buffer[counter] = sample / volume_scale;
+            case 'w':
+                workers = strtol(optarg, &err, 10);
+                if (*err != '\0' || workers <= 0 || workers > 1024) {
+                    fprintf(stderr, "Worker Count Must Be an Integer From 1 to 1024\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-d delay] [-v volume_scale] ... [-f feedback] [-b block_size] [-s] [-S] [-i] [-A depth] src_file dest_file\n"
+                                "       %s [options] -B dir_or_manifest [-o out_dir] [-w workers]\n",
+                           argv[0], argv[0]);
+                   exit(EXIT_FAILURE);
+                }
         }
-        counter++;
-        samples++;
-    }
 
-    // If # of samples < delay, then print what is remaining in echo_buffer
-    if (samples < delay) {
-        fwrite(echo_buffer, sizeof(short), samples, dest_file);
+    EchoTap taps[ECHO_MAX_TAPS];
+    int ntaps = ndelays > nvolume_scales ? ndelays : nvolume_scales;
+    ntaps = ntaps == 0 ? 1 : ntaps;
+    for (int k = 0; k < ntaps; k++) {
+        taps[k].delay = k < ndelays ? delays[k] : 8000;
+        taps[k].volume_scale = k < nvolume_scales ? volume_scales[k] : 4;
     }
 
-    // If not then mix sample[i] with echo_buffer[i] and output to file
-    // Then set echo_buffer[i] equal to sample[i] / volume_scale
-    // until we reach the end of the file, then output what is remaining
-    // in echo_buffer
-    else {
-        while ((r = fread(&sample, sizeof(short), 1, orig))) {
-            short echo_sample = sample / volume_scale;
-
-            short mixed_sample = sample + echo_buffer[echo_index];
-            fwrite(&mixed_sample, sizeof(short), 1, dest_file);
+    // Batch mode: many files over a pool of workers, each reusing its own buffers
+    if (batch_input != NULL) {
+        print_settings(stdout, taps, ntaps, feedback);
 
-            echo_buffer[echo_index] = echo_sample;
-            echo_index = (echo_index + 1) % delay;
+        Worker **pool = malloc(workers * sizeof(Worker *));
+        if (pool == NULL) {
+            fprintf(stderr, "Memory allocation failed for workers\n");
+            exit(EXIT_FAILURE);
         }
-
-        for (int i = echo_index; i < delay; i++) {
-            fwrite(&echo_buffer[i], sizeof(short), 1, dest_file);
+        for (int i = 0; i < workers; i++) {
+            pool[i] = new_worker(taps, ntaps, feedback, saturate, block_size, use_stdio, incremental, async_depth);
+            if (pool[i] == NULL) {
+                fprintf(stderr, "Memory allocation failed for workers\n");
+                exit(EXIT_FAILURE);
+            }
         }
 
-        for (int i = 0; i < echo_index; i++) {
-            fwrite(&echo_buffer[i], sizeof(short), 1, dest_file);
+        int failed = batch_run(batch_input, out_dir, (void **)pool, workers, addecho_file);
+
+        for (int i = 0; i < workers; i++) {
+            free_worker(pool[i]);
         }
+        free(pool);
+        return failed == 0 ? 0 : 1;
     }
 
-    free(echo_buffer);
+    // Checks for empty file parameters
+    if ((optind + 2) != argc) {
+        fprintf(stderr, "Empty File Parameter(s))\n");
+        exit(EXIT_FAILURE);
+    }
 
-    fclose(orig);   
-    fclose(dest_file);
+    // Standard output may be carrying the audio, so the settings go to standard error then
+    FILE *info = strcmp(argv[optind + 1], "-") == 0 ? stderr : stdout;
+    print_settings(info, taps, ntaps, feedback);
+    fprintf(info, "source_file: %s\n", argv[optind]);
+    fprintf(info, "dest_file: %s\n", argv[optind + 1]);
+    fflush(info);
 
-    return 0;
-}
\ No newline at end of file
+    Worker *w = new_worker(taps, ntaps, feedback, saturate, block_size, use_stdio, incremental, async_depth);
+    if (w == NULL) {
+        fprintf(stderr, "Memory allocation failed for block\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int result = addecho_file(w, argv[optind], argv[optind + 1]);
+
+    free_worker(w);
+
+    return result;
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Benchmarks addecho, remvocals and audiochain on a synthetic source made by wavgen, in each of their
+ * I/O modes, and reports throughput, peak RSS and system calls per run. `make bench` builds
+ * everything and runs it with the defaults; compare the table before and after a change.
+ */
+
+#define MAX_ARGS 16
+
+/*
+ * One benchmarked command line. argv holds the tool and its options; the source and
+ * destination are appended when it runs. samples is the number of input samples it processes.
+ */
+typedef struct mode {
+    const char *tool;
+    const char *name;
+    const char *argv[MAX_ARGS];
+    double samples;
+} Mode;
+
+typedef struct result {
+    double seconds;     // Best wall time over the repeats
+    long max_rss_kb;    // Peak resident set of that run
+    long syscalls;      // From a separate traced run, -1 if tracing is not allowed
+} Result;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// In the child: send the tool's own output to /dev/null so only the report is printed.
+static void quiet_child(void) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+}
+
+/*
+ * Run argv to completion. Returns its exit status (or -1 if it could not be run) and fills in
+ * the wall time and peak RSS of the child.
+ */
+static int run_timed(char **argv, double *seconds, long *max_rss_kb) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        quiet_child();
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return -1;
+    }
+    *seconds = now() - start;
+    *max_rss_kb = usage.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Count the system calls argv makes, in every thread it starts, by stopping it at each one
+ * with ptrace. Much slower than a normal run, so it is done separately from the timing.
+ * Each call stops once on entry and once on exit (exit_group only on entry).
+ * Returns -1 where ptrace is not permitted.
+ */
+static long count_syscalls(char **argv) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        quiet_child();
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+            _exit(126);
+        }
+        raise(SIGSTOP);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)options) == -1) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    long stops = 0;
+    pid_t tid;
+    while ((tid = waitpid(-1, &status, __WALL)) != -1) {
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        // Pass real signals on; syscall stops, ptrace events and the SIGSTOP new threads start with are ours
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (status >> 16 != 0 || sig == SIGSTOP) {
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    return (stops + 1) / 2;
+}
+
+// Build the full command line for a mode: options, then source and destination.
+static void build_argv(const Mode *mode, const char *bin_dir, const char *src, const char *dest,
+                       char *tool_path, size_t path_len, char **argv) {
+    snprintf(tool_path, path_len, "%s/%s", bin_dir, mode->tool);
+    int argc = 0;
+    argv[argc++] = tool_path;
+    for (int i = 0; mode->argv[i] != NULL; i++) {
+        argv[argc++] = (char *)mode->argv[i];
+    }
+    if (src != NULL) {
+        argv[argc++] = (char *)src;
+        argv[argc++] = (char *)dest;
+    }
+    argv[argc] = NULL;
+}
+
+static int bench_mode(const Mode *mode, const char *bin_dir, const char *src, const char *dest,
+                      int repeats, int trace, Result *result) {
+    char tool_path[4096];
+    char *argv[MAX_ARGS + 4];
+    build_argv(mode, bin_dir, src, dest, tool_path, sizeof(tool_path), argv);
+
+    result->seconds = -1;
+    for (int r = 0; r < repeats; r++) {
+        double seconds;
+        long rss;
+        if (run_timed(argv, &seconds, &rss) != 0) {
+            return -1;
+        }
+        if (result->seconds < 0 || seconds < result->seconds) {
+            result->seconds = seconds;
+            result->max_rss_kb = rss;
+        }
+    }
+    result->syscalls = trace ? count_syscalls(argv) : -1;
+    return 0;
+}
+
+static void print_result(const Mode *mode, const Result *result, double sample_rate, int channels) {
+    double rate = mode->samples / result->seconds;
+    char syscalls[32] = "n/a";
+    if (result->syscalls >= 0) {
+        snprintf(syscalls, sizeof(syscalls), "%ld", result->syscalls);
+    }
+    printf("%-10s %-22s %9.3f %12.1f %10.0fx %10.1f %10s\n", mode->tool, mode->name, result->seconds,
+           rate / 1e6, rate / (sample_rate * channels), result->max_rss_kb / 1024.0, syscalls);
+}
+
+int main(int argc, char **argv) {
+    double seconds = 600;
+    int channels = 2;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 2;
+    int repeats = 3;
+    int trace = 1;
+    const char *bin_dir = ".";
+    const char *sample_rate = "44100";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:j:n:p:T")) != -1) {
+        switch (opt) {
+            case 's':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'c':
+                channels = atoi(optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'n':
+                repeats = atoi(optarg);
+                break;
+            case 'p':
+                bin_dir = optarg;
+                break;
+            case 'T':
+                trace = 0;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s seconds] [-c channels] [-j threads] [-n repeats] [-p bin_dir] [-T]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (seconds <= 0 || channels <= 0 || threads <= 0 || threads > 64 || repeats <= 0) {
+        fprintf(stderr, "Seconds, Channels, Threads (up to 64) and Repeats Must Be Positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char dir[] = "/tmp/audiobench.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    char src[64], dest[64], batch_dir[64], batch_out[64];
+    snprintf(src, sizeof(src), "%s/in.wav", dir);
+    snprintf(dest, sizeof(dest), "%s/out.wav", dir);
+    snprintf(batch_dir, sizeof(batch_dir), "%s/batch", dir);
+    snprintf(batch_out, sizeof(batch_out), "%s/batch_out", dir);
+
+    // The source is generated fresh each time, so every run measures the same samples
+    char seconds_arg[32], channels_arg[16], threads_arg[16];
+    snprintf(seconds_arg, sizeof(seconds_arg), "%g", seconds);
+    snprintf(channels_arg, sizeof(channels_arg), "%d", channels);
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    Mode generate = {"wavgen", "generate", {"-c", channels_arg, "-r", sample_rate, "-s", seconds_arg, NULL}, 0};
+    char tool_path[4096];
+    char *gen_argv[MAX_ARGS + 4];
+    build_argv(&generate, bin_dir, NULL, NULL, tool_path, sizeof(tool_path), gen_argv);
+    int n = 0;
+    while (gen_argv[n] != NULL) {
+        n++;
+    }
+    gen_argv[n] = src;
+    gen_argv[n + 1] = NULL;
+
+    double gen_seconds;
+    long gen_rss;
+    if (run_timed(gen_argv, &gen_seconds, &gen_rss) != 0) {
+        fprintf(stderr, "Could not generate %s with %s\n", src, tool_path);
+        rmdir(dir);
+        exit(EXIT_FAILURE);
+    }
+
+    // Batch mode gets one hard link to the source per worker
+    mkdir(batch_dir, 0777);
+    for (int i = 0; i < threads; i++) {
+        char link_path[96];
+        snprintf(link_path, sizeof(link_path), "%s/%d.wav", batch_dir, i);
+        link(src, link_path);
+    }
+
+    double samples = seconds * atof(sample_rate) * channels;
+    Mode modes[] = {
+        {"addecho", "stdio (-S -b 1)", {"-S", "-b", "1", NULL}, samples},
+        {"addecho", "block (-S)", {"-S", NULL}, samples},
+        {"addecho", "mmap", {NULL}, samples},
+        {"addecho", "async (-A 4)", {"-A", "4", NULL}, samples},
+        {"addecho", "batch (-w N)", {"-w", threads_arg, "-B", batch_dir, "-o", batch_out, NULL},
+         samples * threads},
+        {"remvocals", "block (-S)", {"-S", NULL}, samples},
+        {"remvocals", "mmap", {NULL}, samples},
+        {"remvocals", "async (-A 4)", {"-A", "4", NULL}, samples},
+        {"remvocals", "threaded (-j N)", {"-j", threads_arg, NULL}, samples},
+        {"audiochain", "remvocals -> echo", {"remvocals -> echo", NULL}, samples},
+    };
+
+    printf("%g s of %d-channel 16-bit audio at %s Hz, %d threads, best of %d\n\n", seconds, channels,
+           sample_rate, threads, repeats);
+    printf("%-10s %-22s %9s %12s %11s %10s %10s\n", "tool", "mode", "seconds", "Msamples/s",
+           "realtime", "RSS MB", "syscalls");
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        // remvocals (also the one in the chain) only takes stereo
+        if (strcmp(modes[i].tool, "addecho") != 0 && channels != 2) {
+            continue;
+        }
+        int batch = modes[i].argv[0] != NULL && strcmp(modes[i].argv[0], "-w") == 0;
+        Result result;
+        if (bench_mode(&modes[i], bin_dir, batch ? NULL : src, dest, repeats, trace, &result) == -1) {
+            printf("%-10s %-22s FAILED\n", modes[i].tool, modes[i].name);
+            failed++;
+            continue;
+        }
+        print_result(&modes[i], &result, atof(sample_rate), channels);
+    }
+
+    // Clean up everything that was made
+    for (int i = 0; i < threads; i++) {
+        char path[96];
+        snprintf(path, sizeof(path), "%s/%d.wav", batch_dir, i);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%d.wav", batch_out, i);
+        unlink(path);
+    }
+    rmdir(batch_dir);
+    rmdir(batch_out);
+    unlink(src);
+    unlink(dest);
+    rmdir(dir);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "echo.h"
+#include "vocals.h"
+#include "wav.h"
+
+#define BLOCK_FRAMES 4096   // Frames per block: small enough to stay in cache through every stage
+#define MAX_STAGES 16
+
+#define STAGE_VOCALS 0
+#define STAGE_ECHO 1
+#define STAGE_GAIN 2
+
+/*
+ * One effect in the chain. Every stage works in place on the same block of unpacked samples
+ * (ints for PCM, floats for float files), so each sample is read and written once per run.
+ */
+typedef struct stage {
+    int kind;
+    int quality;                    // remvocals: VOCALS_TRUNCATE, VOCALS_ROUND or VOCALS_DITHER
+    EchoTap taps[ECHO_MAX_TAPS];    // echo: delays in frames
+    int ntaps;
+    int feedback;
+    int saturate;
+    double gain;                    // gain: factor applied to every sample
+    Echo echo;
+    short *packed;                  // echo: the block as shorts, for the 16-bit SIMD kernels
+    size_t frame;                   // Frames run through this stage so far, which places the dither
+} Stage;
+
+// Parse a positive 32-bit integer option of a stage. Returns it, or -1 after printing why.
+static int parse_positive(const char *stage, const char *key, const char *value) {
+    char *err;
+    long tmp = strtol(value, &err, 10);
+    if (*err != '\0' || tmp <= 0 || tmp > 2147483647) {
+        fprintf(stderr, "%s: %s Must Be a Positive 32-bit Integer\n", stage, key);
+        return -1;
+    }
+    return tmp;
+}
+
+/*
+ * Set one key=value option of stage. Returns 0, or -1 after printing why.
+ * echo takes d and v once per tap, paired in order, like addecho's -d and -v.
+ */
+static int parse_option(Stage *stage, const char *name, char *key, char *value, int *ndelays,
+                        int *nvolume_scales) {
+    if (stage->kind == STAGE_VOCALS && strcmp(key, "q") == 0) {
+        if (strcmp(value, "truncate") == 0) {
+            stage->quality = VOCALS_TRUNCATE;
+        } else if (strcmp(value, "round") == 0) {
+            stage->quality = VOCALS_ROUND;
+        } else if (strcmp(value, "dither") == 0) {
+            stage->quality = VOCALS_DITHER;
+        } else {
+            fprintf(stderr, "%s: q Must Be truncate, round or dither\n", name);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (stage->kind == STAGE_ECHO) {
+        if ((strcmp(key, "d") == 0 && *ndelays == ECHO_MAX_TAPS)
+            || (strcmp(key, "v") == 0 && *nvolume_scales == ECHO_MAX_TAPS)) {
+            fprintf(stderr, "%s: At Most %d Taps Can Be Given\n", name, ECHO_MAX_TAPS);
+            return -1;
+        }
+
+        int *target = strcmp(key, "d") == 0 ? &stage->taps[(*ndelays)++].delay
+                    : strcmp(key, "v") == 0 ? &stage->taps[(*nvolume_scales)++].volume_scale
+                    : strcmp(key, "f") == 0 ? &stage->feedback
+                    : strcmp(key, "s") == 0 ? &stage->saturate : NULL;
+        if (target != NULL) {
+            *target = parse_positive(name, key, value);
+            return *target == -1 ? -1 : 0;
+        }
+    }
+
+    if (stage->kind == STAGE_GAIN && strcmp(key, "g") == 0) {
+        char *err;
+        stage->gain = strtod(value, &err);
+        if (*err != '\0') {
+            fprintf(stderr, "%s: g Must Be a Number\n", name);
+            return -1;
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "%s: Unknown Option %s\n", name, key);
+    return -1;
+}
+
+/*
+ * Parse a chain such as "remvocals -> echo(d=8000,v=4) -> gain(g=0.5)" into stages.
+ * Returns the number of stages, or -1 after printing why.
+ */
+static int parse_chain(const char *spec, Stage *stages) {
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        fprintf(stderr, "Memory allocation failed for chain\n");
+        return -1;
+    }
+
+    int count = 0;
+    char *rest = copy;
+    while (rest != NULL) {
+        char *name = rest;
+        char *arrow = strstr(rest, "->");
+        if (arrow != NULL) {
+            *arrow = '\0';
+            rest = arrow + 2;
+        } else {
+            rest = NULL;
+        }
+
+        // Split "name(args)" and trim the spaces around it
+        while (*name == ' ') {
+            name++;
+        }
+        char *args = strchr(name, '(');
+        if (args != NULL) {
+            *args++ = '\0';
+            char *close = strrchr(args, ')');
+            if (close == NULL) {
+                fprintf(stderr, "%s: Missing )\n", name);
+                free(copy);
+                return -1;
+            }
+            *close = '\0';
+        }
+        for (char *end = name + strlen(name); end > name && end[-1] == ' '; end--) {
+            end[-1] = '\0';
+        }
+
+        if (count == MAX_STAGES) {
+            fprintf(stderr, "At Most %d Stages Can Be Chained\n", MAX_STAGES);
+            free(copy);
+            return -1;
+        }
+        Stage *stage = &stages[count];
+        memset(stage, 0, sizeof(Stage));
+        if (strcmp(name, "remvocals") == 0) {
+            stage->kind = STAGE_VOCALS;
+        } else if (strcmp(name, "echo") == 0) {
+            stage->kind = STAGE_ECHO;
+        } else if (strcmp(name, "gain") == 0) {
+            stage->kind = STAGE_GAIN;
+            stage->gain = 1.0;
+        } else {
+            fprintf(stderr, "Unknown Stage: %s\n", name);
+            free(copy);
+            return -1;
+        }
+
+        int ndelays = 0;
+        int nvolume_scales = 0;
+        for (char *option = args == NULL ? NULL : strtok(args, ","); option != NULL;
+             option = strtok(NULL, ",")) {
+            while (*option == ' ') {
+                option++;
+            }
+            char *value = strchr(option, '=');
+            if (value == NULL) {
+                fprintf(stderr, "%s: Option %s Must Be key=value\n", name, option);
+                free(copy);
+                return -1;
+            }
+            *value++ = '\0';
+            if (parse_option(stage, name, option, value, &ndelays, &nvolume_scales) == -1) {
+                free(copy);
+                return -1;
+            }
+        }
+
+        // A tap missing either value gets addecho's default
+        if (stage->kind == STAGE_ECHO) {
+            stage->ntaps = ndelays > nvolume_scales ? ndelays : nvolume_scales;
+            stage->ntaps = stage->ntaps == 0 ? 1 : stage->ntaps;
+            for (int k = 0; k < stage->ntaps; k++) {
+                stage->taps[k].delay = k < ndelays ? stage->taps[k].delay : 8000;
+                stage->taps[k].volume_scale = k < nvolume_scales ? stage->taps[k].volume_scale : 4;
+            }
+        }
+        count++;
+    }
+    free(copy);
+    return count;
+}
+
+/*
+ * Get every stage ready for a file's format. Returns the number of samples of tail the
+ * echoes add (the chain keeps draining them for that long), or -1 after printing why.
+ */
+static long long start_stages(Stage *stages, int nstages, const WavInfo *info) {
+    long long tail = 0;
+
+    for (int i = 0; i < nstages; i++) {
+        Stage *stage = &stages[i];
+        stage->frame = 0;
+
+        if (stage->kind == STAGE_VOCALS && info->channels != 2) {
+            fprintf(stderr, "remvocals Needs a Stereo Source (it has %d channels)\n", info->channels);
+            return -1;
+        }
+        if (stage->kind != STAGE_ECHO) {
+            continue;
+        }
+
+        // Delays are in frames, so every channel echoes itself
+        EchoTap taps[ECHO_MAX_TAPS];
+        for (int k = 0; k < stage->ntaps; k++) {
+            if (stage->taps[k].delay > 2147483647 / info->channels) {
+                fprintf(stderr, "Delay Too Large for %d Channels\n", info->channels);
+                return -1;
+            }
+            taps[k].delay = stage->taps[k].delay * info->channels;
+            taps[k].volume_scale = stage->taps[k].volume_scale;
+        }
+        // A single echo of 16-bit PCM is packed back to shorts to use the SIMD kernels
+        int type = info->sample_type == WAV_F32 ? ECHO_F32 : ECHO_S32;
+        if (info->sample_type == WAV_S16 && stage->ntaps == 1 && stage->feedback == 0) {
+            type = ECHO_S16;
+            free(stage->packed);
+            stage->packed = malloc((size_t)BLOCK_FRAMES * info->channels * sizeof(short));
+            if (stage->packed == NULL) {
+                fprintf(stderr, "Memory allocation failed for block\n");
+                return -1;
+            }
+        }
+        if (echo_init_taps(&stage->echo, type, info->bits_per_sample, taps, stage->ntaps,
+                           stage->feedback, stage->saturate, 0) == -1) {
+            fprintf(stderr, "Memory allocation failed for echo_buffer\n");
+            return -1;
+        }
+        tail += stage->echo.delay;
+    }
+    return tail;
+}
+
+// Multiply by the gain, rounding to nearest and saturating PCM to its width. Float is not clipped.
+static void apply_gain(const Stage *stage, const WavInfo *info, void *work, size_t samples) {
+    if (info->sample_type == WAV_F32) {
+        float *x = work;
+        const float gain = stage->gain;
+        for (size_t i = 0; i < samples; i++) {
+            x[i] *= gain;
+        }
+        return;
+    }
+
+    int *x = work;
+    const double max = (double)((1LL << (info->bits_per_sample - 1)) - 1);
+    const double min = -max - 1;
+    for (size_t i = 0; i < samples; i++) {
+        // Adding and subtracting 1.5 * 2^52 rounds to nearest even
+        double v = (x[i] * stage->gain + 6755399441055744.0) - 6755399441055744.0;
+        x[i] = v > max ? max : v < min ? min : v;
+    }
+}
+
+/*
+ * Run one block of unpacked samples through every stage in turn, in place.
+ * Returns 0, or -1 if an echo stage failed.
+ */
+static int run_stages(Stage *stages, int nstages, const WavInfo *info, void *work, size_t samples) {
+    const size_t frames = samples / info->channels;
+
+    for (int i = 0; i < nstages; i++) {
+        Stage *stage = &stages[i];
+        switch (stage->kind) {
+            case STAGE_VOCALS:
+                if (info->sample_type == WAV_F32) {
+                    remove_vocals_f32(work, work, frames);
+                } else if (stage->quality == VOCALS_TRUNCATE) {
+                    remove_vocals_s32(work, work, frames);
+                } else {
+                    remove_vocals_rounded_s32(work, work, frames, stage->frame,
+                                              stage->quality == VOCALS_DITHER, info->bits_per_sample);
+                }
+                break;
+
+            case STAGE_ECHO: {
+                int mixed;
+                if (stage->echo.type == ECHO_S16) {
+                    wav_encode(info, work, stage->packed, samples);
+                    mixed = echo_mix(&stage->echo, stage->packed, stage->packed, samples);
+                    wav_decode(info, stage->packed, work, samples);
+                } else {
+                    mixed = echo_mix(&stage->echo, work, work, samples);
+                }
+                if (mixed == -1) {
+                    fprintf(stderr, "Could not read or write the spilled echo_buffer\n");
+                    return -1;
+                }
+                break;
+            }
+
+            case STAGE_GAIN:
+                apply_gain(stage, info, work, samples);
+                break;
+        }
+        stage->frame += frames;
+    }
+    return 0;
+}
+
+/*
+ * Run one block of the tail, starting done samples past the end of the source, through the chain.
+ * Each stage only sees as much tail as the tools run one after another would give it: its input
+ * ends where the echoes before it stop ringing, and an echo rings for its delay past that. The
+ * rest of the block is silence, so a dithering stage leaves no noise where its input has ended.
+ * Returns 0, or -1 if an echo stage failed.
+ */
+static int drain_stages(Stage *stages, int nstages, const WavInfo *info, void *work,
+                        size_t samples, long long done) {
+    long long end = 0;
+
+    for (int i = 0; i < nstages; i++) {
+        if (stages[i].kind == STAGE_ECHO) {
+            end += stages[i].echo.delay;
+        }
+        size_t live = end <= done ? 0 : end - done < (long long)samples ? end - done : samples;
+        if (live > 0 && run_stages(&stages[i], 1, info, work, live) == -1) {
+            return -1;
+        }
+        memset((int *)work + live, 0, (samples - live) * sizeof(int));
+    }
+    return 0;
+}
+
+// Regular files and block devices can be seeked back into to patch the header.
+static int is_seekable(FILE *f) {
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+           && fseeko(f, 0, SEEK_CUR) == 0;
+}
+
+/*
+ * The single pass: read a block, unpack it, run it through the chain and write it out, then
+ * keep the chain running on silence until every echo has drained. The header is handled the way
+ * addecho does it: real sizes up front when known, patched at the end when the output can seek.
+ * Returns 0 on success and -1 on failure.
+ */
+static int run_chain(Stage *stages, int nstages, FILE *src, FILE *dest) {
+    WavInfo info;
+    int err = wav_read_header(src, &info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+        return -1;
+    }
+    long long tail = start_stages(stages, nstages, &info);
+    if (tail == -1) {
+        return -1;
+    }
+
+    // Streaming encoders writing to a pipe leave the data size at 0 or WAV_SIZE_UNKNOWN
+    if (info.data_size == 0 && !is_seekable(src)) {
+        info.data_size = WAV_SIZE_UNKNOWN;
+    }
+    size_t remaining = (size_t)-1;
+    size_t data_size = WAV_SIZE_UNKNOWN;
+    if (info.data_size != WAV_SIZE_UNKNOWN) {
+        remaining = info.data_size / info.block_align;
+        data_size = (remaining * info.channels + tail) * info.sample_bytes;
+    }
+
+    int seekable = is_seekable(dest);
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &info, seekable ? data_size : WAV_SIZE_UNKNOWN);
+    fwrite(header, WAV_HEADER_BYTES, 1, dest);
+
+    // Samples are at most 4 bytes, packed or unpacked
+    unsigned char *block = malloc((size_t)BLOCK_FRAMES * info.channels * sizeof(int));
+    void *work = malloc((size_t)BLOCK_FRAMES * info.channels * sizeof(int));
+    if (block == NULL || work == NULL) {
+        fprintf(stderr, "Memory allocation failed for block\n");
+        free(block);
+        free(work);
+        return -1;
+    }
+
+    int result = 0;
+    size_t written = 0;
+    size_t r;
+    while (result == 0 && remaining > 0) {
+        size_t want = remaining < BLOCK_FRAMES ? remaining : BLOCK_FRAMES;
+        if ((r = fread(block, info.block_align, want, src)) == 0) {
+            break;
+        }
+        size_t samples = r * info.channels;
+        if (info.sample_type == WAV_F32) {
+            memcpy(work, block, samples * sizeof(float));
+        } else {
+            wav_decode(&info, block, work, samples);
+        }
+
+        result = run_stages(stages, nstages, &info, work, samples);
+
+        if (info.sample_type == WAV_F32) {
+            memcpy(block, work, samples * sizeof(float));
+        } else {
+            wav_encode(&info, work, block, samples);
+        }
+        fwrite(block, info.sample_bytes, samples, dest);
+        remaining -= r;
+        written += samples;
+    }
+
+    // Drain the echoes: silence is all-zero in both ints and floats. The tail is whole frames.
+    for (long long done = 0; result == 0 && done < tail; done += r) {
+        r = tail - done < (long long)BLOCK_FRAMES * info.channels ? tail - done
+                                                                  : (size_t)BLOCK_FRAMES * info.channels;
+        memset(work, 0, r * sizeof(int));
+        result = drain_stages(stages, nstages, &info, work, r, done);
+
+        if (info.sample_type == WAV_F32) {
+            memcpy(block, work, r * sizeof(float));
+        } else {
+            wav_encode(&info, work, block, r);
+        }
+        fwrite(block, info.sample_bytes, r, dest);
+        written += r;
+    }
+    free(block);
+    free(work);
+    if (result == -1) {
+        return -1;
+    }
+
+    // Chunks are word aligned, so an odd-sized data chunk gets a pad byte
+    if (written * info.sample_bytes % 2) {
+        fputc(0, dest);
+    }
+
+    // Deferred fix-up: now that the real size is known, patch it in if we can seek back
+    if (seekable && written * info.sample_bytes != data_size) {
+        wav_make_header(header, &info, written * info.sample_bytes);
+        if (fseeko(dest, 0, SEEK_SET) != 0 || fwrite(header, WAV_HEADER_BYTES, 1, dest) != 1
+            || fseeko(dest, 0, SEEK_END) != 0) {
+            perror("audiochain: header fix-up");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s \"stage -> stage ...\" src_file dest_file\n"
+                        "Stages: remvocals[(q=truncate|round|dither)]\n"
+                        "        echo[(d=delay,v=volume_scale,...,f=feedback,s=1)]\n"
+                        "        gain(g=factor)\n", argv[0]);
+        return 1;
+    }
+
+    Stage stages[MAX_STAGES];
+    int nstages = parse_chain(argv[1], stages);
+    if (nstages == -1) {
+        return 1;
+    }
+
+    FILE *src = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "rb");
+    if (src == NULL) {
+        fprintf(stderr, "Invalid File: %s\n", argv[2]);
+        return 1;
+    }
+    FILE *dest = strcmp(argv[3], "-") == 0 ? stdout : fopen(argv[3], "wb");
+    if (dest == NULL) {
+        fprintf(stderr, "Invalid File: %s\n", argv[3]);
+        fclose(src);
+        return 1;
+    }
+
+    int result = run_chain(stages, nstages, src, dest);
+
+    for (int i = 0; i < nstages; i++) {
+        if (stages[i].kind == STAGE_ECHO) {
+            echo_free(&stages[i].echo);
+            free(stages[i].packed);
+        }
+    }
+    fclose(src);
+    if (fclose(dest) != 0) {
+        perror("fclose");
+        result = -1;
+    }
+    return result == 0 ? 0 : 1;
+}
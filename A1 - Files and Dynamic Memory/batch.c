@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+typedef struct batch_item {
+    char *src;
+    char *dest;
+    const char *rejected; // Why the item is not run, NULL if it is
+} BatchItem;
+
+/*
+ * Identifies the file a path names: the file itself if it exists, otherwise the directory
+ * it would be created in and its name there. Two paths with equal keys are the same file.
+ */
+typedef struct path_key {
+    dev_t dev;
+    ino_t ino;
+    const char *name; // NULL when dev and ino are the file's own
+    int item;
+    int is_src;
+} PathKey;
+
+/*
+ * Shared by the pool: workers claim the next item under lock and add their
+ * results to the totals.
+ */
+typedef struct batch {
+    BatchItem *items;
+    int count;
+    int capacity;
+    int next;
+    int failed;
+    double bytes;
+    pthread_mutex_t lock;
+    BatchFn fn;
+} Batch;
+
+typedef struct batch_worker {
+    Batch *batch;
+    void *state;
+} BatchWorker;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    const char *base = strrchr(name, '/');
+    base = base == NULL ? name : base + 1;
+
+    char *path = malloc(strlen(dir) + strlen(base) + 2);
+    if (path != NULL) {
+        sprintf(path, "%s/%s", dir, base);
+    }
+    return path;
+}
+
+static int add_item(Batch *batch, const char *src, const char *dest, const char *out_dir) {
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        BatchItem *items = realloc(batch->items, capacity * sizeof(BatchItem));
+        if (items == NULL) {
+            return -1;
+        }
+        batch->items = items;
+        batch->capacity = capacity;
+    }
+
+    BatchItem *item = &batch->items[batch->count];
+    item->rejected = NULL;
+    item->src = strdup(src);
+    item->dest = dest != NULL ? strdup(dest) : join_path(out_dir, src);
+    if (item->src == NULL || item->dest == NULL) {
+        free(item->src);
+        free(item->dest);
+        return -1;
+    }
+    batch->count++;
+    return 0;
+}
+
+static int list_directory(Batch *batch, const char *dir_path, const char *out_dir) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        perror(dir_path);
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= 4 || strcasecmp(entry->d_name + len - 4, ".wav") != 0) {
+            continue;
+        }
+
+        char *src = join_path(dir_path, entry->d_name);
+        if (src == NULL || add_item(batch, src, NULL, out_dir) == -1) {
+            free(src);
+            closedir(dir);
+            return -1;
+        }
+        free(src);
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int list_manifest(Batch *batch, const char *manifest, const char *out_dir) {
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL) {
+        perror(manifest);
+        return -1;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *src = strtok(line, " \t\r\n");
+        char *dest = strtok(NULL, " \t\r\n");
+        if (src == NULL || src[0] == '#') {
+            continue;
+        }
+        if (add_item(batch, src, dest, out_dir) == -1) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Fills in key for path. Returns -1 if neither the file nor its directory can be found,
+ * in which case nothing can clash with it (and fn will fail to open it anyway).
+ */
+static int path_key(const char *path, PathKey *key) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        key->dev = st.st_dev;
+        key->ino = st.st_ino;
+        key->name = NULL;
+        return 0;
+    }
+
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    int found = dir != NULL && stat(dir, &st) == 0;
+    free(dir);
+    if (!found) {
+        return -1;
+    }
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->name = slash == NULL ? path : slash + 1;
+    return 0;
+}
+
+// Orders keys by the file they name; 0 means the same file.
+static int compare_files(const PathKey *x, const PathKey *y) {
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    if ((x->name == NULL) != (y->name == NULL)) {
+        return x->name == NULL ? -1 : 1;
+    }
+    return x->name == NULL ? 0 : strcmp(x->name, y->name);
+}
+
+// Orders keys so that the same file comes together, sources first, then in item order.
+static int compare_keys(const void *a, const void *b) {
+    const PathKey *x = a;
+    const PathKey *y = b;
+    int files = compare_files(x, y);
+    if (files != 0) {
+        return files;
+    }
+    if (x->is_src != y->is_src) {
+        return y->is_src - x->is_src;
+    }
+    return x->item - y->item;
+}
+
+/*
+ * Reject the items that would write over a file the batch reads (their own source, with
+ * -o pointing at the input directory) or over another item's output (two sources with the
+ * same name in different directories). Outputs are truncated when opened, so either would
+ * destroy data before it is read. Returns -1 if out of memory.
+ */
+static int reject_clashes(Batch *batch) {
+    PathKey *keys = malloc(2 * batch->count * sizeof(PathKey));
+    if (keys == NULL && batch->count > 0) {
+        return -1;
+    }
+
+    int nkeys = 0;
+    for (int i = 0; i < batch->count; i++) {
+        for (int is_src = 0; is_src < 2; is_src++) {
+            PathKey *key = &keys[nkeys];
+            if (path_key(is_src ? batch->items[i].src : batch->items[i].dest, key) == 0) {
+                key->item = i;
+                key->is_src = is_src;
+                nkeys++;
+            }
+        }
+    }
+    qsort(keys, nkeys, sizeof(PathKey), compare_keys);
+
+    for (int start = 0, end; start < nkeys; start = end) {
+        // keys[start..end) all name the same file, any sources first
+        end = start + 1;
+        while (end < nkeys && compare_files(&keys[start], &keys[end]) == 0) {
+            end++;
+        }
+
+        for (int k = start; k < end; k++) {
+            if (keys[k].is_src) {
+                continue;
+            }
+            BatchItem *item = &batch->items[keys[k].item];
+            if (keys[start].is_src) {
+                item->rejected = "would overwrite an input";
+            } else if (k > start) {
+                item->rejected = "would overwrite another file's output";
+            }
+        }
+    }
+    free(keys);
+    return 0;
+}
+
+static void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            break;
+        }
+
+        BatchItem *item = &batch->items[i];
+        if (item->rejected != NULL) {
+            pthread_mutex_lock(&batch->lock);
+            batch->failed++;
+            printf("%s -> %s: FAILED (%s)\n", item->src, item->dest, item->rejected);
+            pthread_mutex_unlock(&batch->lock);
+            continue;
+        }
+
+        struct stat st;
+        double bytes = stat(item->src, &st) == 0 ? st.st_size : 0;
+
+        double start = now();
+        int result = batch->fn(worker->state, item->src, item->dest);
+        double seconds = now() - start;
+
+        pthread_mutex_lock(&batch->lock);
+        if (result != 0) {
+            batch->failed++;
+            printf("%s -> %s: FAILED\n", item->src, item->dest);
+        } else {
+            batch->bytes += bytes;
+            printf("%s -> %s: %.1f MB in %.3f s (%.1f MB/s)\n", item->src, item->dest,
+                   bytes / 1e6, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0);
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+int batch_run(const char *input, const char *out_dir, void **workers, int nworkers, BatchFn fn) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.fn = fn;
+
+    if (mkdir(out_dir, 0777) == -1 && errno != EEXIST) {
+        perror(out_dir);
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(input, &st) == -1) {
+        perror(input);
+        return -1;
+    }
+    int listed = S_ISDIR(st.st_mode) ? list_directory(&batch, input, out_dir)
+                                      : list_manifest(&batch, input, out_dir);
+    if (listed == -1) {
+        fprintf(stderr, "Could not list the files in %s\n", input);
+        return -1;
+    }
+    if (reject_clashes(&batch) == -1) {
+        fprintf(stderr, "Memory allocation failed for the file list\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_t *threads = malloc(nworkers * sizeof(pthread_t));
+    BatchWorker *pool = malloc(nworkers * sizeof(BatchWorker));
+    if (threads == NULL || pool == NULL) {
+        fprintf(stderr, "Memory allocation failed for workers\n");
+        return -1;
+    }
+
+    double start = now();
+    int started = 0;
+    for (int i = 0; i < nworkers; i++) {
+        pool[i].batch = &batch;
+        pool[i].state = workers[i];
+        if (pthread_create(&threads[started], NULL, batch_worker, &pool[i]) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        // Could not start any thread, so do the work on this one
+        batch_worker(&pool[0]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = now() - start;
+
+    printf("%d files, %d failed, %.1f MB in %.3f s (%.1f MB/s) on %d workers\n",
+           batch.count, batch.failed, batch.bytes / 1e6, seconds,
+           seconds > 0 ? batch.bytes / 1e6 / seconds : 0, started == 0 ? 1 : started);
+
+    for (int i = 0; i < batch.count; i++) {
+        free(batch.items[i].src);
+        free(batch.items[i].dest);
+    }
+    free(batch.items);
+    free(threads);
+    free(pool);
+    pthread_mutex_destroy(&batch.lock);
+    return batch.failed;
+}
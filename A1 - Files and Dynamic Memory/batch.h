@@ -0,0 +1,24 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Processes one file with a worker's state (buffers that are reused from file to file).
+ * Returns 0 on success and non-zero on failure.
+ */
+typedef int (*BatchFn)(void *worker, const char *src, const char *dest);
+
+/*
+ * Run fn over every file listed by input on a pool of nworkers threads, one per workers[i].
+ *
+ * input is either a directory, in which case every .wav file in it is processed into
+ * out_dir under the same name, or a manifest with one "src [dest]" pair per line
+ * (dest defaults to out_dir/basename of src; blank lines and lines starting with # are skipped).
+ * out_dir is created if it does not exist. Files whose dest is one of the inputs, or the dest
+ * of an earlier file, are not processed and count as failed.
+ *
+ * Prints one line per file and an aggregate line with the throughput.
+ * Returns the number of files that failed, or -1 if the input could not be listed.
+ */
+int batch_run(const char *input, const char *out_dir, void **workers, int nworkers, BatchFn fn);
+
+#endif
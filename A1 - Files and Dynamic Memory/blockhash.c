@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockhash.h"
+
+#define SIDECAR_MAGIC "AEBLOCK1"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+// Header of a sidecar file; nblocks hashes follow it
+typedef struct sidecar_header {
+    char magic[8];
+    unsigned long long params;
+    unsigned long long block_samples;
+    unsigned long long samples;
+    unsigned long long nblocks;
+    unsigned long long dest_size;
+    long long dest_mtime;
+} SidecarHeader;
+
+static unsigned long long rotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long round_word(unsigned long long lane, unsigned long long word) {
+    return rotl(lane + word * PRIME2, 31) * PRIME1;
+}
+
+/*
+ * Four independent lanes of 8-byte words, so the multiplies overlap and a block hashes at
+ * memory speed; the lanes, the leftover bytes and the length are folded together at the end.
+ */
+unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed) {
+    const unsigned char *p = data;
+    unsigned long long lane[4] = {seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1};
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned long long word[4];
+        memcpy(word, p + i, sizeof(word));
+        for (int k = 0; k < 4; k++) {
+            lane[k] = round_word(lane[k], word[k]);
+        }
+    }
+
+    unsigned long long h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+    for (; i < len; i++) {
+        h = rotl(h ^ (p[i] * PRIME3), 11) * PRIME1;
+    }
+    h ^= len;
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    return h ^ (h >> 32);
+}
+
+int hashes_compute(BlockHashes *h, const void *data, size_t samples, int sample_bytes,
+                   size_t block_samples) {
+    h->block_samples = block_samples;
+    h->samples = samples;
+    h->nblocks = (samples + block_samples - 1) / block_samples;
+    h->hash = malloc((h->nblocks == 0 ? 1 : h->nblocks) * sizeof(unsigned long long));
+    if (h->hash == NULL) {
+        return -1;
+    }
+
+    const unsigned char *p = data;
+    for (size_t j = 0; j < h->nblocks; j++) {
+        size_t start = j * block_samples;
+        size_t n = samples - start < block_samples ? samples - start : block_samples;
+        h->hash[j] = hash_bytes(p + start * sample_bytes, n * sample_bytes, 0);
+    }
+    return 0;
+}
+
+int hashes_load(const char *path, BlockHashes *h) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    SidecarHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0
+        || header.block_samples == 0
+        || header.nblocks != (header.samples + header.block_samples - 1) / header.block_samples) {
+        fclose(f);
+        return -1;
+    }
+
+    h->params = header.params;
+    h->block_samples = header.block_samples;
+    h->samples = header.samples;
+    h->nblocks = header.nblocks;
+    h->dest_size = header.dest_size;
+    h->dest_mtime = header.dest_mtime;
+    h->hash = malloc((h->nblocks == 0 ? 1 : h->nblocks) * sizeof(unsigned long long));
+    if (h->hash == NULL || fread(h->hash, sizeof(unsigned long long), h->nblocks, f) != h->nblocks) {
+        free(h->hash);
+        h->hash = NULL;
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int hashes_save(const char *path, const BlockHashes *h) {
+    char *tmp_path = malloc(strlen(path) + 5);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Memory allocation failed for sidecar\n");
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    SidecarHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.params = h->params;
+    header.block_samples = h->block_samples;
+    header.samples = h->samples;
+    header.nblocks = h->nblocks;
+    header.dest_size = h->dest_size;
+    header.dest_mtime = h->dest_mtime;
+
+    // Written beside the old sidecar and renamed over it, so a crash never leaves half of one
+    FILE *f = fopen(tmp_path, "wb");
+    int failed = f == NULL
+                 || fwrite(&header, sizeof(header), 1, f) != 1
+                 || fwrite(h->hash, sizeof(unsigned long long), h->nblocks, f) != h->nblocks;
+    if (f != NULL && fclose(f) != 0) {
+        failed = 1;
+    }
+    if (failed || rename(tmp_path, path) == -1) {
+        perror(path);
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
+
+void hashes_free(BlockHashes *h) {
+    free(h->hash);
+    h->hash = NULL;
+}
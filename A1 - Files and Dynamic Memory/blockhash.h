@@ -0,0 +1,40 @@
+#ifndef BLOCKHASH_H
+#define BLOCKHASH_H
+
+#include <stddef.h>
+
+#define BLOCK_HASH_FRAMES 16384     // Frames of source covered by one block hash
+
+/*
+ * Hashes of a source, one per block of block_samples samples (the last block may be short),
+ * plus what else decides the output: params covers the effect settings and sample format,
+ * and dest_size and dest_mtime record the destination as it was left, so one edited since
+ * is not trusted. Saved next to the destination as a sidecar for the next run to compare.
+ */
+typedef struct block_hashes {
+    unsigned long long params;
+    size_t block_samples;
+    size_t samples;
+    size_t nblocks;
+    size_t dest_size;
+    long long dest_mtime;       // Nanoseconds since the epoch
+    unsigned long long *hash;
+} BlockHashes;
+
+// Hash len bytes, starting from seed (so separate values can be chained into one hash).
+unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed);
+
+// Hash every block of samples samples of sample_bytes bytes each.
+// Returns 0, or -1 if memory runs out.
+int hashes_compute(BlockHashes *h, const void *data, size_t samples, int sample_bytes,
+                   size_t block_samples);
+
+// Read a sidecar written by hashes_save. Returns 0, or -1 if it is missing or not valid.
+int hashes_load(const char *path, BlockHashes *h);
+
+// Write h to path, replacing it in one step. Returns 0, or -1 after printing why.
+int hashes_save(const char *path, const BlockHashes *h);
+
+void hashes_free(BlockHashes *h);
+
+#endif
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <aio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "blockio.h"
+
+#define MAX_DEPTH 64
+
+// States of a block buffer as it goes round
+#define BUF_FREE 0
+#define BUF_READING 1
+#define BUF_READY 2     // Read, waiting its turn for fn
+#define BUF_WRITING 3
+
+/*
+ * The io_uring rings, set up with raw system calls (there is no liburing to link against).
+ * We are the only submitter and the only reaper, so only the kernel's side of each ring
+ * needs acquire and release ordering.
+ */
+typedef struct uring {
+    int fd;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_bytes;
+    size_t cq_ring_bytes;
+    size_t sqes_bytes;
+    unsigned int queued;        // Requests written to the ring but not yet passed to the kernel
+} Uring;
+
+typedef struct blockio {
+    int use_uring;
+    Uring uring;
+    struct aiocb cbs[MAX_DEPTH];    // POSIX AIO: one control block per buffer
+    int active[MAX_DEPTH];          // POSIX AIO: buffers with a request outstanding
+} Blockio;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void uring_close(Uring *u) {
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_bytes);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_bytes);
+    }
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_bytes);
+    }
+    close(u->fd);
+}
+
+/*
+ * Whether the kernel can do the plain reads and writes we queue. IORING_OP_READ and _WRITE came
+ * in 5.6, together with the probe; on 5.1 to 5.5 a ring sets up fine but every request would
+ * fail with EINVAL, and there the probe itself fails.
+ */
+static int uring_supports_rw(Uring *u) {
+    const int nops = 256;
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + nops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        return 0;
+    }
+    int supported = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, nops) == 0
+                    && probe->ops_len > IORING_OP_WRITE
+                    && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+                    && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/*
+ * Set up a ring with room for entries requests. Returns 0, or -1 if io_uring is not available
+ * or cannot do plain reads and writes.
+ */
+static int uring_open(Uring *u, unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(Uring));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+
+    u->sq_ring_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_ring_bytes = u->cq_ring_bytes > u->sq_ring_bytes ? u->cq_ring_bytes : u->sq_ring_bytes;
+        u->cq_ring_bytes = u->sq_ring_bytes;
+    }
+    u->sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        uring_close(u);
+        return -1;
+    }
+    u->cq_ring = u->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(NULL, u->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes = mmap(NULL, u->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        u->cq_ring = u->cq_ring == MAP_FAILED ? NULL : u->cq_ring;
+        u->sqes = u->sqes == MAP_FAILED ? NULL : u->sqes;
+        uring_close(u);
+        return -1;
+    }
+
+    unsigned char *sq = u->sq_ring;
+    unsigned char *cq = u->cq_ring;
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (!uring_supports_rw(u)) {
+        uring_close(u);
+        return -1;
+    }
+    return 0;
+}
+
+// Pass every queued request to the kernel, and wait for at least wait completions.
+static int uring_enter(Uring *u, unsigned int wait) {
+    while (1) {
+        long r = syscall(__NR_io_uring_enter, u->fd, u->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+        if (r >= 0) {
+            u->queued -= r < u->queued ? r : u->queued;
+            return 0;
+        }
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+static void queue_request(Blockio *io, int buffer, int write, int fd, void *buf, size_t len, off_t offset) {
+    if (io->use_uring) {
+        Uring *u = &io->uring;
+        unsigned int tail = *u->sq_tail;
+        unsigned int index = tail & *u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)buf;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = buffer;
+        u->sq_array[index] = index;
+        __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        u->queued++;
+        return;
+    }
+
+    struct aiocb *cb = &io->cbs[buffer];
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = fd;
+    cb->aio_buf = buf;
+    cb->aio_nbytes = len;
+    cb->aio_offset = offset;
+    int started = write ? aio_write(cb) : aio_read(cb);
+    if (started == -1) {
+        // Reported when it is reaped, like a failed io_uring request
+        cb->aio_nbytes = (size_t)-1;
+    }
+    io->active[buffer] = 1;
+}
+
+// Start everything queued without waiting, so it runs while the caller works.
+static int submit_requests(Blockio *io) {
+    return io->use_uring && io->uring.queued > 0 ? uring_enter(&io->uring, 0) : 0;
+}
+
+/*
+ * Wait for one request to finish. Sets *buffer to the buffer it was for and *result to the
+ * bytes transferred, or minus the errno. Returns 0, or -1 if waiting itself failed.
+ */
+static int reap_request(Blockio *io, int depth, int *buffer, long *result) {
+    if (io->use_uring) {
+        Uring *u = &io->uring;
+        while (1) {
+            unsigned int head = *u->cq_head;
+            if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+                *buffer = cqe->user_data;
+                *result = cqe->res;
+                __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+            if (uring_enter(u, 1) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    while (1) {
+        const struct aiocb *list[MAX_DEPTH];
+        for (int i = 0; i < depth; i++) {
+            list[i] = NULL;
+            if (!io->active[i]) {
+                continue;
+            }
+            if (io->cbs[i].aio_nbytes == (size_t)-1) {
+                *result = -EIO;
+            } else if (aio_error(&io->cbs[i]) == EINPROGRESS) {
+                list[i] = &io->cbs[i];
+                continue;
+            } else {
+                *result = aio_return(&io->cbs[i]);
+                *result = *result == -1 ? -aio_error(&io->cbs[i]) : *result;
+            }
+            io->active[i] = 0;
+            *buffer = i;
+            return 0;
+        }
+        if (aio_suspend(list, depth, NULL) == -1 && errno != EINTR) {
+            perror("aio_suspend");
+            return -1;
+        }
+    }
+}
+
+/*
+ * Block k always goes through buffer k % depth: it is read there, waits its turn, is passed to fn
+ * and written back out from the same buffer, which only then is free for block k + depth.
+ * A read or write that transfers less than asked is queued again for the rest of the block.
+ */
+int blockio_copy(int src_fd, off_t src_offset, int dest_fd, off_t dest_offset, size_t len,
+                 size_t block_bytes, int depth, BlockFn fn, void *state, BlockioStats *stats) {
+    depth = depth < 1 ? 1 : depth > MAX_DEPTH ? MAX_DEPTH : depth;
+    const size_t nblocks = (len + block_bytes - 1) / block_bytes;
+
+    Blockio *io = calloc(1, sizeof(Blockio));
+    unsigned char *buffers = aligned_alloc(4096, (block_bytes + 4095) / 4096 * 4096 * depth);
+    if (io == NULL || buffers == NULL) {
+        fprintf(stderr, "Memory allocation failed for I/O blocks\n");
+        free(io);
+        free(buffers);
+        return -1;
+    }
+    const size_t stride = (block_bytes + 4095) / 4096 * 4096;
+
+    const char *backend = getenv("BLOCKIO_BACKEND");
+    io->use_uring = (backend == NULL || strcmp(backend, "posix_aio") != 0)
+                    && uring_open(&io->uring, depth) == 0;
+    stats->backend = io->use_uring ? "io_uring" : "posix_aio";
+    stats->depth = depth;
+
+    int state_of[MAX_DEPTH] = {0};
+    size_t block_of[MAX_DEPTH];
+    size_t progress[MAX_DEPTH] = {0};  // Bytes of the block read or written so far
+    size_t next_read = 0, next_fn = 0, written = 0;
+    int in_flight = 0;
+    double in_flight_sum = 0;
+    long waits = 0;
+    int result = 0;
+    double start = now();
+
+    while (written < nblocks && result == 0) {
+        // Read ahead into every free buffer
+        while (next_read < nblocks && state_of[next_read % depth] == BUF_FREE) {
+            int b = next_read % depth;
+            size_t n = len - next_read * block_bytes < block_bytes ? len - next_read * block_bytes : block_bytes;
+            queue_request(io, b, 0, src_fd, buffers + b * stride, n, src_offset + next_read * block_bytes);
+            state_of[b] = BUF_READING;
+            progress[b] = 0;
+            block_of[b] = next_read++;
+            in_flight++;
+        }
+        if (submit_requests(io) == -1) {
+            result = -1;
+            break;
+        }
+
+        // Blocks go through fn strictly in order
+        int b = next_fn % depth;
+        if (next_fn < nblocks && state_of[b] == BUF_READY && block_of[b] == next_fn) {
+            size_t n = len - next_fn * block_bytes < block_bytes ? len - next_fn * block_bytes : block_bytes;
+            if (fn(state, buffers + b * stride, n) == -1) {
+                result = -1;
+                break;
+            }
+            queue_request(io, b, 1, dest_fd, buffers + b * stride, n, dest_offset + next_fn * block_bytes);
+            state_of[b] = BUF_WRITING;
+            progress[b] = 0;
+            next_fn++;
+            in_flight++;
+            continue;
+        }
+
+        int done;
+        long transferred;
+        in_flight_sum += in_flight;
+        waits++;
+        if (reap_request(io, depth, &done, &transferred) == -1) {
+            result = -1;
+            break;
+        }
+        in_flight--;
+        size_t k = block_of[done];
+        size_t want = len - k * block_bytes < block_bytes ? len - k * block_bytes : block_bytes;
+        int writing = state_of[done] == BUF_WRITING;
+        if (transferred > 0) {
+            progress[done] += transferred;
+        }
+        if (progress[done] < want && (transferred > 0 || transferred == -EINTR || transferred == -EAGAIN)) {
+            // Short transfer: ask for the rest of the block
+            size_t at = progress[done];
+            queue_request(io, done, writing, writing ? dest_fd : src_fd, buffers + done * stride + at,
+                          want - at, (writing ? dest_offset : src_offset) + k * block_bytes + at);
+            in_flight++;
+            continue;
+        }
+        if (progress[done] != want) {
+            fprintf(stderr, "%s of block %zu failed: %s\n", writing ? "Write" : "Read", k,
+                    transferred < 0 ? strerror(-transferred) : writing ? "nothing written" : "unexpected end of file");
+            result = -1;
+            break;
+        }
+        state_of[done] = state_of[done] == BUF_READING ? BUF_READY : BUF_FREE;
+        written += state_of[done] == BUF_FREE;
+    }
+
+    // Requests still in flight write into the buffers, so they have to finish before those are freed.
+    // If waiting for them fails, in_flight stays above zero and nothing is freed.
+    while (in_flight > 0) {
+        int done;
+        long transferred;
+        if (submit_requests(io) == -1 || reap_request(io, depth, &done, &transferred) == -1) {
+            break;
+        }
+        in_flight--;
+    }
+
+    stats->seconds = now() - start;
+    stats->bytes = 2.0 * len;
+    stats->average_in_flight = waits > 0 ? in_flight_sum / waits : 0;
+    if (io->use_uring) {
+        uring_close(&io->uring);
+    }
+    if (in_flight > 0) {
+        // Waiting failed, so some requests may still land in the buffers (and for POSIX AIO
+        // in its control blocks). Closing the ring does not wait for them: leak both instead.
+        return -1;
+    }
+    free(io);
+    free(buffers);
+    return result;
+}
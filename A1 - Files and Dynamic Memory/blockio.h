@@ -0,0 +1,35 @@
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BLOCKIO_DEPTH 4             // Blocks in flight by default: one mixing, the others being read or written
+#define BLOCKIO_BLOCK (1 << 20)     // Default bytes per block
+
+// Processes one block in place, in file order. Returns 0, or -1 to stop the copy.
+typedef int (*BlockFn)(void *state, unsigned char *block, size_t bytes);
+
+// What a copy did, for the tools to report.
+typedef struct blockio_stats {
+    const char *backend;        // "io_uring" or "posix_aio"
+    int depth;                  // Blocks allocated, so the most requests that can be in flight
+    double average_in_flight;   // Reads and writes outstanding, averaged over every wait
+    double bytes;               // Read plus written
+    double seconds;
+} BlockioStats;
+
+/*
+ * Read len bytes of src_fd from src_offset, run fn over them one block at a time, and write each
+ * block to dest_fd at the same distance from dest_offset. Up to depth blocks are in flight, so
+ * while fn works on one block, the next ones are already being read and the last ones are still
+ * being written. block_bytes should be a whole number of frames.
+ *
+ * Uses io_uring where the kernel has it with plain reads and writes (5.6 on), and POSIX AIO
+ * otherwise (or when the BLOCKIO_BACKEND environment variable is posix_aio). Returns 0, or -1
+ * after printing why.
+ */
+int blockio_copy(int src_fd, off_t src_offset, int dest_fd, off_t dest_offset, size_t len,
+                 size_t block_bytes, int depth, BlockFn fn, void *state, BlockioStats *stats);
+
+#endif
@@ -0,0 +1,690 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "echo.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ECHO_X86 1
+#endif
+
+#define TAP_SPAN 1024       // Most samples a multi-tap step mixes at once
+#define SPILL_WINDOW 65536  // Samples of a spilled ring mixed at once (a power of two)
+#define SPILL_CHUNK (SPILL_WINDOW / 2)
+
+typedef void (*MixSpan)(const void *in, void *out, void *ring, int n, const Echo *echo);
+
+static MixSpan mix_span = NULL;     // ECHO_S16 kernel picked for this CPU
+static const char *kernel_name = "scalar";
+static pthread_once_t kernel_picked = PTHREAD_ONCE_INIT; // Batch workers init echoes at once
+
+/*
+ * Division by volume_scale without a divide.
+ * For |sample| <= 32768 and 2 <= volume_scale <= 32768, with l = ceil(log2(volume_scale)),
+ * shift = 15 + l and magic = ceil(2^shift / volume_scale), (|sample| * magic) >> shift
+ * equals |sample| / volume_scale exactly. magic always fits in 16 bits, which is what the
+ * SIMD kernels rely on (they take the high half of a 16x16 multiply, then shift by shift - 16).
+ */
+static void find_magic(Echo *echo) {
+    int d = echo->volume_scale;
+
+    if (d == 1) {
+        echo->magic = 1 << 15;
+        echo->shift = 15;
+        return;
+    }
+    if (d > 32768) {
+        // Every 16-bit sample divides down to 0
+        echo->magic = 0;
+        echo->shift = 16;
+        return;
+    }
+
+    int l = 0;
+    while ((1 << l) < d) {
+        l++;
+    }
+    echo->shift = 15 + l;
+    echo->magic = (unsigned int)(((1ULL << echo->shift) + d - 1) / d);
+}
+
+static inline short scale_sample(short sample, unsigned int magic, int shift) {
+    unsigned int mag = sample < 0 ? -(int)sample : sample;
+    int q = (mag * magic) >> shift;
+    return sample < 0 ? -q : q;
+}
+
+static inline short mix_sample(short sample, short echo_sample, int saturate) {
+    int mixed = sample + echo_sample;
+    if (saturate) {
+        mixed = mixed > 32767 ? 32767 : mixed;
+        mixed = mixed < -32768 ? -32768 : mixed;
+    }
+    return mixed;
+}
+
+static inline void scalar_span(const short *in, short *out, short *ring, int n, const Echo *echo,
+                               int saturate) {
+    const unsigned int magic = echo->magic;
+    const int shift = echo->shift;
+
+    for (int j = 0; j < n; j++) {
+        short sample = in[j];
+        out[j] = mix_sample(sample, ring[j], saturate);
+        ring[j] = scale_sample(sample, magic, shift);
+    }
+}
+
+static void mix_span_scalar(const void *in, void *out, void *ring, int n, const Echo *echo) {
+    if (echo->saturate) {
+        scalar_span(in, out, ring, n, echo, 1);
+    } else {
+        scalar_span(in, out, ring, n, echo, 0);
+    }
+}
+
+/*
+ * 8, 24 and 32-bit PCM arrive as ints (and 16-bit too, when a caller works in ints). The mix is
+ * done in 64 bits and then wrapped (or saturated) to the sample width, matching what the
+ * 16-bit kernels do for shorts.
+ */
+static inline void s32_span(const int *in, int *out, int *ring, int n, const Echo *echo,
+                            int saturate, int narrow) {
+    const long long max = (1LL << (echo->bits - 1)) - 1;
+    const long long min = -max - 1;
+    const int wrap = 64 - echo->bits;
+    const int volume_scale = echo->volume_scale;
+    const unsigned int magic = echo->magic;
+    const int shift = echo->shift;
+
+    for (int j = 0; j < n; j++) {
+        int sample = in[j];
+        long long mixed = (long long)sample + ring[j];
+        if (saturate) {
+            mixed = mixed > max ? max : mixed;
+            mixed = mixed < min ? min : mixed;
+        } else {
+            mixed = (long long)((unsigned long long)mixed << wrap) >> wrap;
+        }
+        out[j] = mixed;
+        ring[j] = narrow ? scale_sample(sample, magic, shift) : sample / volume_scale;
+    }
+}
+
+static void mix_span_s32(const void *in, void *out, void *ring, int n, const Echo *echo) {
+    // Samples of 16 bits or less divide exactly with the 16-bit magic multiply
+    int narrow = echo->bits <= 16;
+    if (echo->saturate) {
+        narrow ? s32_span(in, out, ring, n, echo, 1, 1) : s32_span(in, out, ring, n, echo, 1, 0);
+    } else {
+        narrow ? s32_span(in, out, ring, n, echo, 0, 1) : s32_span(in, out, ring, n, echo, 0, 0);
+    }
+}
+
+// Float samples saturate to [-1, 1]; without -s they are left unclipped.
+static void mix_span_f32(const void *in_span, void *out_span, void *ring_span, int n,
+                         const Echo *echo) {
+    const float *in = in_span;
+    float *out = out_span;
+    float *ring = ring_span;
+    const float volume_scale = echo->volume_scale;
+
+    for (int j = 0; j < n; j++) {
+        float sample = in[j];
+        float mixed = sample + ring[j];
+        if (echo->saturate) {
+            mixed = mixed > 1.0f ? 1.0f : mixed;
+            mixed = mixed < -1.0f ? -1.0f : mixed;
+        }
+        out[j] = mixed;
+        ring[j] = sample / volume_scale;
+    }
+}
+
+#ifdef ECHO_X86
+
+__attribute__((target("sse2"), always_inline))
+static inline void sse2_span(const short *in, short *out, short *ring, int n, const Echo *echo,
+                             int saturate) {
+    const __m128i magic = _mm_set1_epi16((short)echo->magic);
+    const __m128i shift = _mm_cvtsi32_si128(echo->shift - 16);
+    const int unit = echo->volume_scale == 1;
+    int j = 0;
+
+    for (; j + 8 <= n; j += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + j));
+        __m128i r = _mm_loadu_si128((const __m128i *)(ring + j));
+
+        // |x| as an unsigned 16-bit value (-32768 becomes 32768), divided, then the sign put back
+        __m128i sign = _mm_srai_epi16(x, 15);
+        __m128i q = x;
+        if (!unit) {
+            __m128i mag = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+            q = _mm_srl_epi16(_mm_mulhi_epu16(mag, magic), shift);
+            q = _mm_sub_epi16(_mm_xor_si128(q, sign), sign);
+        }
+
+        __m128i mixed = saturate ? _mm_adds_epi16(x, r) : _mm_add_epi16(x, r);
+        _mm_storeu_si128((__m128i *)(out + j), mixed);
+        _mm_storeu_si128((__m128i *)(ring + j), q);
+    }
+    mix_span_scalar(in + j, out + j, ring + j, n - j, echo);
+}
+
+__attribute__((target("sse2")))
+static void mix_span_sse2(const void *in, void *out, void *ring, int n, const Echo *echo) {
+    if (echo->saturate) {
+        sse2_span(in, out, ring, n, echo, 1);
+    } else {
+        sse2_span(in, out, ring, n, echo, 0);
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void avx2_span(const short *in, short *out, short *ring, int n, const Echo *echo,
+                             int saturate) {
+    const __m256i magic = _mm256_set1_epi16((short)echo->magic);
+    const __m128i shift = _mm_cvtsi32_si128(echo->shift - 16);
+    const int unit = echo->volume_scale == 1;
+    int j = 0;
+
+    for (; j + 16 <= n; j += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(in + j));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(ring + j));
+
+        __m256i sign = _mm256_srai_epi16(x, 15);
+        __m256i q = x;
+        if (!unit) {
+            __m256i mag = _mm256_sub_epi16(_mm256_xor_si256(x, sign), sign);
+            q = _mm256_srl_epi16(_mm256_mulhi_epu16(mag, magic), shift);
+            q = _mm256_sub_epi16(_mm256_xor_si256(q, sign), sign);
+        }
+
+        __m256i mixed = saturate ? _mm256_adds_epi16(x, r) : _mm256_add_epi16(x, r);
+        _mm256_storeu_si256((__m256i *)(out + j), mixed);
+        _mm256_storeu_si256((__m256i *)(ring + j), q);
+    }
+    mix_span_scalar(in + j, out + j, ring + j, n - j, echo);
+}
+
+__attribute__((target("avx2")))
+static void mix_span_avx2(const void *in, void *out, void *ring, int n, const Echo *echo) {
+    if (echo->saturate) {
+        avx2_span(in, out, ring, n, echo, 1);
+    } else {
+        avx2_span(in, out, ring, n, echo, 0);
+    }
+}
+
+#endif
+
+// Pick the widest kernel the CPU supports. ADDECHO_KERNEL=scalar|sse2|avx2 overrides it.
+static void pick_kernel(void) {
+    const char *wanted = getenv("ADDECHO_KERNEL");
+
+    mix_span = mix_span_scalar;
+    kernel_name = "scalar";
+    if (wanted != NULL && strcmp(wanted, "scalar") == 0) {
+        return;
+    }
+
+#ifdef ECHO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (wanted == NULL || strcmp(wanted, "avx2") == 0)) {
+        mix_span = mix_span_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2") && (wanted == NULL || strcmp(wanted, "sse2") == 0
+                                                    || strcmp(wanted, "avx2") == 0)) {
+        mix_span = mix_span_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+int echo_sample_bytes(int type) {
+    return type == ECHO_S16 ? sizeof(short) : type == ECHO_S32 ? sizeof(int) : sizeof(float);
+}
+
+// Largest ring kept in memory; ADDECHO_RING_LIMIT (bytes) overrides it.
+static size_t ring_limit(void) {
+    const char *limit = getenv("ADDECHO_RING_LIMIT");
+    return limit != NULL ? strtoull(limit, NULL, 10) : ECHO_RING_LIMIT;
+}
+
+static void release_spill(Echo *echo) {
+    if (echo->storage == ECHO_RING_FILE) {
+        close(echo->fd);
+    }
+    free(echo->window);
+    echo->window = NULL;
+    echo->storage = ECHO_RING_MEMORY;
+}
+
+/*
+ * Move bytes between buf and offset of the spill file, retrying short transfers.
+ * A failure (ENOSPC, most likely) is recorded in echo->failed.
+ */
+static void spill_io(Echo *echo, int write, void *buf, size_t len, size_t offset) {
+    while (len > 0 && !echo->failed) {
+        ssize_t done = write ? pwrite(echo->fd, buf, len, offset) : pread(echo->fd, buf, len, offset);
+        if (done <= 0) {
+            echo->failed = 1;
+            return;
+        }
+        buf = (char *)buf + done;
+        len -= done;
+        offset += done;
+    }
+}
+
+/*
+ * Give the ring samples zeroed samples of storage: in memory (the buffer is reused when it is
+ * large enough), or, when that is more than the ring limit (and the window), as a sparse,
+ * already unlinked temp file that is mixed through a window of SPILL_WINDOW samples.
+ */
+static int alloc_ring(Echo *echo, size_t samples, int type) {
+    size_t bytes = samples * echo_sample_bytes(type);
+
+    release_spill(echo);
+    echo->failed = 0;
+    echo->cached = 0;
+    if (bytes > ring_limit() && samples > SPILL_WINDOW) {
+        const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/addecho.XXXXXX", dir);
+        echo->fd = mkstemp(path);
+        if (echo->fd == -1) {
+            return -1;
+        }
+        unlink(path);
+        // The window, plus a read-ahead cache per tap for the multi-tap line
+        echo->window = malloc(((size_t)SPILL_WINDOW + (size_t)echo->ntaps * SPILL_CHUNK) * sizeof(int));
+        if (ftruncate(echo->fd, bytes) == -1 || echo->window == NULL) {
+            close(echo->fd);
+            free(echo->window);
+            echo->window = NULL;
+            return -1;
+        }
+        echo->storage = ECHO_RING_FILE;
+        return 0;
+    }
+
+    if (echo->buffer != NULL && echo->capacity >= bytes) {
+        memset(echo->buffer, 0, bytes);
+    } else {
+        free(echo->buffer);
+        echo->buffer = calloc(samples, echo_sample_bytes(type));
+        echo->capacity = echo->buffer == NULL ? 0 : bytes;
+        if (echo->buffer == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int echo_init(Echo *echo, int type, int bits, int delay, int volume_scale, int saturate) {
+    EchoTap tap = {delay, volume_scale};
+    return echo_init_taps(echo, type, bits, &tap, 1, 0, saturate, 0);
+}
+
+int echo_init_taps(Echo *echo, int type, int bits, const EchoTap *taps, int ntaps, int feedback,
+                   int saturate, int lookback) {
+    pthread_once(&kernel_picked, pick_kernel);
+
+    int longest = 0;
+    int shortest = TAP_SPAN;
+    for (int k = 0; k < ntaps; k++) {
+        longest = taps[k].delay > longest ? taps[k].delay : longest;
+        shortest = taps[k].delay < shortest ? taps[k].delay : shortest;
+    }
+    echo->type = type;
+    echo->bits = bits;
+    echo->delay = longest;
+    echo->index = 0;
+    echo->volume_scale = taps[0].volume_scale;
+    echo->saturate = saturate;
+    find_magic(echo);
+    memcpy(echo->taps, taps, ntaps * sizeof(EchoTap));
+    echo->ntaps = ntaps;
+    echo->feedback = feedback;
+    echo->span = shortest;
+    echo->head = 0;
+
+    // A power-of-two line lets every tap find its slot with a mask.
+    // A single echo needs exactly delay samples, walked in order.
+    size_t length = 1;
+    if (ntaps > 1 || feedback != 0) {
+        while (length < (size_t)longest) {
+            length <<= 1;
+        }
+    } else {
+        length = longest;
+    }
+    echo->mask = length - 1;
+
+    // Without feedback the line is only the source itself, so a caller that can hand over
+    // the delayed samples needs no ring at all
+    if (lookback && feedback == 0 && length * echo_sample_bytes(type) > ring_limit()) {
+        release_spill(echo);
+        echo->storage = ECHO_RING_NONE;
+        echo->failed = 0;
+        return 0;
+    }
+
+    // The ring starts zeroed, so the first delay samples pass through unchanged
+    // and a source shorter than delay is padded with silence before its echo.
+    return alloc_ring(echo, length, type);
+}
+
+// Move n samples between buf and the spill file, starting at line position at.
+static void spill_line(Echo *echo, int write, void *buf, size_t at, size_t n) {
+    const int bytes = echo_sample_bytes(echo->type);
+    const size_t start = at & echo->mask;
+    const size_t before_wrap = echo->mask + 1 - start;
+    const size_t first = before_wrap < n ? before_wrap : n;
+
+    spill_io(echo, write, buf, first * bytes, start * bytes);
+    spill_io(echo, write, (char *)buf + first * bytes, (n - first) * bytes, 0);
+}
+
+/*
+ * Return n samples of the multi-tap line as tap k sees them (starting delay samples behind head),
+ * either where they lie or copied into buf when the ring wraps in the middle.
+ *
+ * A spilled line keeps its last SPILL_WINDOW samples in memory too, which is where taps shorter
+ * than that read. Longer taps read ahead SPILL_CHUNK samples at a time into their own cache:
+ * everything more than SPILL_CHUNK behind head has already been written back to the file.
+ */
+static const void *line_read(Echo *echo, int k, int n, void *buf) {
+    const int bytes = echo_sample_bytes(echo->type);
+    const size_t from = echo->head - echo->taps[k].delay;
+    const void *ring = echo->buffer;
+    size_t mask = echo->mask;
+
+    if (echo->storage == ECHO_RING_FILE) {
+        if (echo->taps[k].delay > SPILL_WINDOW) {
+            char *cache = (char *)echo->window + ((size_t)SPILL_WINDOW + (size_t)k * SPILL_CHUNK) * bytes;
+            if (!(echo->cached & (1u << k)) || from - echo->cached_from[k] > (size_t)(SPILL_CHUNK - n)) {
+                spill_line(echo, 0, cache, from, SPILL_CHUNK);
+                echo->cached_from[k] = from;
+                echo->cached |= 1u << k;
+            }
+            return cache + (from - echo->cached_from[k]) * bytes;
+        }
+        ring = echo->window;
+        mask = SPILL_WINDOW - 1;
+    }
+
+    const size_t start = from & mask;
+    const size_t before_wrap = mask + 1 - start;
+    if (before_wrap >= (size_t)n) {
+        return (const char *)ring + start * bytes;
+    }
+    memcpy(buf, (const char *)ring + start * bytes, before_wrap * bytes);
+    memcpy((char *)buf + before_wrap * bytes, ring, (n - before_wrap) * bytes);
+    return buf;
+}
+
+// Store n samples of buf into the multi-tap line at head. A spilled line writes whole chunks back.
+static void line_write(Echo *echo, int n, const void *buf) {
+    const int bytes = echo_sample_bytes(echo->type);
+    void *ring = echo->buffer;
+    size_t mask = echo->mask;
+
+    if (echo->storage == ECHO_RING_FILE) {
+        ring = echo->window;
+        mask = SPILL_WINDOW - 1;
+    }
+
+    const size_t start = echo->head & mask;
+    const size_t before_wrap = mask + 1 - start;
+    const size_t first = before_wrap < (size_t)n ? before_wrap : (size_t)n;
+    memcpy((char *)ring + start * bytes, buf, first * bytes);
+    memcpy(ring, (const char *)buf + first * bytes, (n - first) * bytes);
+
+    // n is at most TAP_SPAN, so at most one chunk fills up
+    const size_t end = echo->head + n;
+    if (echo->storage == ECHO_RING_FILE && end / SPILL_CHUNK != echo->head / SPILL_CHUNK) {
+        size_t chunk = end / SPILL_CHUNK * SPILL_CHUNK - SPILL_CHUNK;
+        spill_line(echo, 1, (char *)ring + (chunk & mask) * bytes, chunk, SPILL_CHUNK);
+    }
+}
+
+/*
+ * Multi-tap engine. Each step mixes up to span samples: first every tap adds its
+ * stretch of the line into acc (one sequential read per tap), then the outputs are written
+ * and the line is extended. A step never reaches past the shortest tap, so every sample a tap
+ * reads was written in an earlier step.
+ */
+static void mix_taps_s32(Echo *echo, const int *in, int *out, int n) {
+    const long long max = (1LL << (echo->bits - 1)) - 1;
+    const long long min = -max - 1;
+    const int wrap = 64 - echo->bits;
+    const int feedback = echo->feedback;
+    long long acc[TAP_SPAN];
+    int buf[TAP_SPAN];
+    int line[TAP_SPAN];
+
+    for (int i = 0; i < n; ) {
+        int span = n - i < echo->span ? n - i : echo->span;
+
+        memset(acc, 0, span * sizeof(acc[0]));
+        for (int k = 0; k < echo->ntaps; k++) {
+            const int volume_scale = echo->taps[k].volume_scale;
+            const int *tap = line_read(echo, k, span, buf);
+            for (int j = 0; j < span; j++) {
+                acc[j] += tap[j] / volume_scale;
+            }
+        }
+
+        for (int j = 0; j < span; j++) {
+            long long sample = in == NULL ? 0 : in[i + j];
+            long long mixed = sample + acc[j];
+            long long fed = feedback ? sample + acc[j] / feedback : sample;
+            if (echo->saturate) {
+                mixed = mixed > max ? max : mixed < min ? min : mixed;
+                fed = fed > max ? max : fed < min ? min : fed;
+            } else {
+                mixed = (long long)((unsigned long long)mixed << wrap) >> wrap;
+                fed = (long long)((unsigned long long)fed << wrap) >> wrap;
+            }
+            out[i + j] = mixed;
+            line[j] = fed;
+        }
+        line_write(echo, span, line);
+        echo->head += span;
+        i += span;
+    }
+}
+
+static void mix_taps_f32(Echo *echo, const float *in, float *out, int n) {
+    const float feedback = echo->feedback;
+    float acc[TAP_SPAN];
+    float buf[TAP_SPAN];
+    float line[TAP_SPAN];
+
+    for (int i = 0; i < n; ) {
+        int span = n - i < echo->span ? n - i : echo->span;
+
+        memset(acc, 0, span * sizeof(acc[0]));
+        for (int k = 0; k < echo->ntaps; k++) {
+            const float volume_scale = echo->taps[k].volume_scale;
+            const float *tap = line_read(echo, k, span, buf);
+            for (int j = 0; j < span; j++) {
+                acc[j] += tap[j] / volume_scale;
+            }
+        }
+
+        for (int j = 0; j < span; j++) {
+            float sample = in == NULL ? 0.0f : in[i + j];
+            float mixed = sample + acc[j];
+            float fed = feedback != 0.0f ? sample + acc[j] / feedback : sample;
+            if (echo->saturate) {
+                mixed = mixed > 1.0f ? 1.0f : mixed < -1.0f ? -1.0f : mixed;
+                fed = fed > 1.0f ? 1.0f : fed < -1.0f ? -1.0f : fed;
+            }
+            out[i + j] = mixed;
+            line[j] = fed;
+        }
+        line_write(echo, span, line);
+        echo->head += span;
+        i += span;
+    }
+}
+
+/*
+ * Each output sample is the input sample plus the echo stored delay samples ago,
+ * and the ring slot is then refilled with input / volume_scale.
+ * The ring is walked in contiguous spans so there is no modulo per sample.
+ * A spilled ring is read into the window a span at a time, mixed there and written back.
+ */
+int echo_mix(Echo *echo, const void *in, void *out, int n) {
+    static const char silence[4096];
+
+    if (echo->ntaps > 1 || echo->feedback != 0) {
+        if (echo->type == ECHO_F32) {
+            mix_taps_f32(echo, in, out, n);
+        } else {
+            mix_taps_s32(echo, in, out, n);
+        }
+        return echo->failed ? -1 : 0;
+    }
+
+    const int bytes = echo_sample_bytes(echo->type);
+    MixSpan span_kernel = echo->type == ECHO_S16 ? mix_span
+                        : echo->type == ECHO_S32 ? mix_span_s32 : mix_span_f32;
+
+    int i = 0;
+    while (i < n) {
+        int span = echo->delay - echo->index;
+        if (span > n - i) {
+            span = n - i;
+        }
+
+        // Silence is all-zero bytes in every sample type, so it is mixed from a static block
+        const char *src = (const char *)in + (size_t)i * bytes;
+        if (in == NULL) {
+            if (span > (int)sizeof(silence) / bytes) {
+                span = sizeof(silence) / bytes;
+            }
+            src = silence;
+        }
+
+        void *ring = (char *)echo->buffer + (size_t)echo->index * bytes;
+        if (echo->storage == ECHO_RING_FILE) {
+            span = span < SPILL_WINDOW ? span : SPILL_WINDOW;
+            ring = echo->window;
+            spill_io(echo, 0, ring, (size_t)span * bytes, (size_t)echo->index * bytes);
+        }
+
+        span_kernel(src, (char *)out + (size_t)i * bytes, ring, span, echo);
+
+        if (echo->storage == ECHO_RING_FILE) {
+            spill_io(echo, 1, ring, (size_t)span * bytes, (size_t)echo->index * bytes);
+        }
+
+        i += span;
+        echo->index += span;
+        if (echo->index == echo->delay) {
+            echo->index = 0;
+        }
+    }
+    return echo->failed ? -1 : 0;
+}
+
+/*
+ * Lookback: with no ring, each tap's echo is read from the source itself, delay samples
+ * back. The sums are done in the same order as the ring's, so the output is identical.
+ */
+void echo_mix_lookback(const Echo *echo, const void *in, const void *const *delayed, void *out,
+                       int n) {
+    static const char silence[TAP_SPAN * sizeof(int)];
+
+    if (echo->type == ECHO_S16) {
+        // Only a single echo runs on shorts
+        const short *x = in;
+        const short *d = delayed[0];
+        short *y = out;
+        if (d == NULL) {
+            if (x == NULL) {
+                memset(y, 0, n * sizeof(short));
+            } else if (x != y) {
+                memcpy(y, x, n * sizeof(short));
+            }
+        } else if (x == NULL) {
+            for (int j = 0; j < n; j++) {
+                y[j] = scale_sample(d[j], echo->magic, echo->shift);
+            }
+        } else {
+            for (int j = 0; j < n; j++) {
+                y[j] = mix_sample(x[j], scale_sample(d[j], echo->magic, echo->shift), echo->saturate);
+            }
+        }
+        return;
+    }
+
+    // Silent taps and input are read from a zero block, a span at a time
+    for (int i = 0; i < n; ) {
+        int span = n - i < TAP_SPAN ? n - i : TAP_SPAN;
+
+        if (echo->type == ECHO_F32) {
+            const float *x = in == NULL ? (const float *)silence : (const float *)in + i;
+            float acc[TAP_SPAN] = {0};
+            for (int k = 0; k < echo->ntaps; k++) {
+                const float volume_scale = echo->taps[k].volume_scale;
+                const float *d = delayed[k] == NULL ? (const float *)silence
+                               : (const float *)delayed[k] + i;
+                for (int j = 0; j < span; j++) {
+                    acc[j] += d[j] / volume_scale;
+                }
+            }
+            float *y = (float *)out + i;
+            for (int j = 0; j < span; j++) {
+                float mixed = x[j] + acc[j];
+                if (echo->saturate) {
+                    mixed = mixed > 1.0f ? 1.0f : mixed < -1.0f ? -1.0f : mixed;
+                }
+                y[j] = mixed;
+            }
+        } else {
+            const long long max = (1LL << (echo->bits - 1)) - 1;
+            const long long min = -max - 1;
+            const int wrap = 64 - echo->bits;
+            const int *x = in == NULL ? (const int *)silence : (const int *)in + i;
+            long long acc[TAP_SPAN] = {0};
+            for (int k = 0; k < echo->ntaps; k++) {
+                const int volume_scale = echo->taps[k].volume_scale;
+                const int *d = delayed[k] == NULL ? (const int *)silence : (const int *)delayed[k] + i;
+                for (int j = 0; j < span; j++) {
+                    acc[j] += d[j] / volume_scale;
+                }
+            }
+            int *y = (int *)out + i;
+            for (int j = 0; j < span; j++) {
+                long long mixed = x[j] + acc[j];
+                if (echo->saturate) {
+                    mixed = mixed > max ? max : mixed < min ? min : mixed;
+                } else {
+                    mixed = (long long)((unsigned long long)mixed << wrap) >> wrap;
+                }
+                y[j] = mixed;
+            }
+        }
+        i += span;
+    }
+}
+
+void echo_free(Echo *echo) {
+    release_spill(echo);
+    free(echo->buffer);
+    echo->buffer = NULL;
+    echo->capacity = 0;
+}
+
+const char *echo_kernel_name(void) {
+    pthread_once(&kernel_picked, pick_kernel);
+    return kernel_name;
+}
@@ -0,0 +1,100 @@
+#ifndef ECHO_H
+#define ECHO_H
+
+#include <stddef.h>
+
+// Sample types the echo ring can mix
+#define ECHO_S16 0      // short samples, mixed by the SIMD kernels
+#define ECHO_S32 1      // int samples holding 8, 24 or 32-bit PCM
+#define ECHO_F32 2      // float samples
+
+#define ECHO_MAX_TAPS 16
+
+// Where the ring lives
+#define ECHO_RING_MEMORY 0  // In buffer
+#define ECHO_RING_FILE 1    // In an unlinked temp file, for rings over the limit
+#define ECHO_RING_NONE 2    // Nowhere: the caller passes the delayed samples to echo_mix_lookback
+
+#define ECHO_RING_LIMIT (16 << 20)  // Largest ring kept in memory, in bytes
+
+// One echo of a multi-tap line: delay samples back, divided by volume_scale.
+typedef struct echo_tap {
+    int delay;
+    int volume_scale;
+} EchoTap;
+
+/*
+ * Echo ring shared by the addecho block loop.
+ * buffer holds delay samples that were already divided by volume_scale,
+ * index points at the oldest one (the next echo to be mixed in).
+ * For interleaved audio, delay is the delay in frames times the channel count.
+ *
+ * With several taps or feedback the ring instead holds the undivided delay line: slot
+ * head & mask is the next to be written, and each tap reads its own distance behind it.
+ * delay is then the longest tap, which is also how long the tail runs.
+ *
+ * Rings bigger than ECHO_RING_LIMIT are spilled to a temp file, so memory stays bounded
+ * whatever the delay; without feedback a caller holding the whole source can skip the ring.
+ */
+typedef struct echo {
+    void *buffer;
+    size_t capacity;        // Bytes allocated for buffer, kept when the ring is reused
+    int type;               // ECHO_S16, ECHO_S32 or ECHO_F32
+    int bits;               // Width ECHO_S32 samples wrap or saturate to (8, 24 or 32)
+    int delay;
+    int index;
+    int volume_scale;
+    int saturate;           // Clamp mixed samples to the sample range instead of wrapping
+
+    // sample / volume_scale is computed as sign * ((|sample| * magic) >> shift)
+    unsigned int magic;
+    int shift;
+
+    // Multi-tap delay line
+    EchoTap taps[ECHO_MAX_TAPS];
+    int ntaps;
+    int feedback;           // The line is fed x + echo / feedback instead of x; 0 for none
+    int span;               // Samples mixed per step: at most the shortest tap
+    size_t head;
+    size_t mask;            // Ring length (a power of two) - 1
+
+    int storage;            // ECHO_RING_MEMORY, ECHO_RING_FILE or ECHO_RING_NONE
+    int fd;                 // Spill file
+    void *window;           // The part of a spilled ring being mixed
+    size_t cached_from[ECHO_MAX_TAPS];  // Line position each long tap's read-ahead starts at
+    unsigned int cached;                // Bit k set when tap k's read-ahead is filled
+    int failed;             // A spill read or write failed
+} Echo;
+
+// Set up (or reset) the ring. The Echo must start zeroed; calling echo_init again reuses the
+// existing buffer when it is large enough. Returns 0 on success, -1 if the ring could not be allocated.
+int echo_init(Echo *echo, int type, int bits, int delay, int volume_scale, int saturate);
+
+// Set up a multi-tap line: out = x + sum of line[-delay] / volume_scale over the taps, all mixed
+// in one pass over one ring. feedback > 0 feeds the echoes back into the line divided by feedback.
+// One tap without feedback is the same as echo_init. Multi-tap lines take ECHO_S32 or ECHO_F32
+// samples only (16-bit PCM goes in as ECHO_S32 with bits 16).
+// lookback says the caller can use echo_mix_lookback instead; if there is no feedback and the ring
+// would be over the limit, none is allocated and storage is ECHO_RING_NONE.
+int echo_init_taps(Echo *echo, int type, int bits, const EchoTap *taps, int ntaps, int feedback,
+                   int saturate, int lookback);
+
+// Mixes n samples of in against the ring and stores them in out (in may equal out).
+// Passing in == NULL mixes silence, which drains the ring into out.
+// Returns 0, or -1 if a spilled ring could not be read or written.
+int echo_mix(Echo *echo, const void *in, void *out, int n);
+
+// Mix n samples of in with the samples each tap echoes, delayed[k] (NULL for silence, as is in),
+// into out. Gives the same output as echo_mix without keeping a ring; no feedback.
+void echo_mix_lookback(const Echo *echo, const void *in, const void *const *delayed, void *out,
+                       int n);
+
+// Bytes per sample of an echo type.
+int echo_sample_bytes(int type);
+
+void echo_free(Echo *echo);
+
+// Name of the mix kernel picked for this CPU ("avx2", "sse2" or "scalar").
+const char *echo_kernel_name(void);
+
+#endif
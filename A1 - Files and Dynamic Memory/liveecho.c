@@ -0,0 +1,678 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "echo.h"
+#include "wav.h"
+
+/*
+ * Live echo: the addecho ring run on PCM as it arrives from a FIFO, a Unix socket or a pipe,
+ * one small fixed quantum at a time. A reader thread fills quanta from the source and hands
+ * them to the mixer thread through a lock-free single-producer single-consumer ring, so a slow
+ * read never holds up the mix and the mixer never takes a lock. Each quantum is timed from
+ * the moment its last byte arrived to the moment it was written out, and the latency
+ * percentiles are printed when the stream ends (or on SIGINT / SIGTERM).
+ *
+ * With -L the source and destination are a built-in loopback: a generator thread plays a
+ * tone in real time into one socket and a sink thread times every quantum coming back out of
+ * the other, which gives the end-to-end latency as well.
+ */
+
+#define DEFAULT_QUANTUM 128     // Frames mixed at a time
+#define RING_SLOTS 64           // Quanta the reader can get ahead of the mixer (a power of two)
+#define SPIN_LIMIT 2000         // Polls before the mixer sleeps on the ring
+#define HIST_US 10000           // Latency histogram: 1 us buckets up to 10 ms, then one overflow bucket
+#define SENT_SLOTS 8192         // Loopback send times kept, indexed by quantum (a power of two)
+
+/*
+ * Quanta handed from the reader to the mixer. Only the reader moves head and only the mixer
+ * moves tail; slot head % RING_SLOTS is filled before head is published (release), and read
+ * after it is seen (acquire). The mixer sleeps on a futex on head once polling gives up, and
+ * sets waiting first so the reader knows to wake it.
+ */
+typedef struct slot {
+    long long arrival;          // When the last byte was read, in ns
+    size_t samples;             // 0 marks the end of the stream
+    unsigned char *data;
+} Slot;
+
+typedef struct spsc {
+    Slot slots[RING_SLOTS];
+    _Atomic unsigned int head;
+    _Atomic unsigned int tail;
+    _Atomic int waiting;
+    _Atomic unsigned long full;     // Times the reader found the ring full (the mixer fell behind)
+} Spsc;
+
+typedef struct histogram {
+    unsigned long long count[HIST_US + 1];
+    unsigned long long n;
+    long long max_ns;
+} Histogram;
+
+typedef struct live {
+    int in_fd;
+    int out_fd;
+    WavInfo info;
+    int quantum;                // Frames per quantum
+    Spsc ring;
+    Echo echo;
+    int *work;                  // A quantum unpacked, for PCM the echo cannot mix where it lies
+    Histogram latency;          // Arrival to written, per quantum
+} Live;
+
+// Loopback test rig (-L)
+typedef struct loopback {
+    int source_fd;              // Generator end of the source socket
+    int sink_fd;                // Sink end of the destination socket
+    WavInfo info;
+    int quantum;
+    long long quanta;           // How many the generator plays
+    _Atomic long long sent[SENT_SLOTS];
+    long long late;             // Quanta that came back more than one quantum period after they were sent
+    Histogram latency;          // Sent to received, per quantum
+} Loopback;
+
+static atomic_int stop = 0;
+static int wake_pipe[2] = {-1, -1};     // Gets a byte when the stream stops, to end blocked reads
+
+// Stop the stream, from any thread or from a signal handler (the atomic is lock-free).
+static void stop_stream(void) {
+    atomic_store_explicit(&stop, 1, memory_order_release);
+    char byte = 0;
+    if (write(wake_pipe[1], &byte, 1) == -1) {
+        // Full already, so nobody is left to wake
+    }
+}
+
+static int stopped(void) {
+    return atomic_load_explicit(&stop, memory_order_acquire);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_stream();
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void record(Histogram *h, long long ns) {
+    long long us = ns / 1000;
+    h->count[us < HIST_US ? us : HIST_US]++;
+    h->n++;
+    h->max_ns = ns > h->max_ns ? ns : h->max_ns;
+}
+
+// Smallest latency, in us, that at least fraction p of the quanta came in under.
+static double percentile(const Histogram *h, double p) {
+    unsigned long long want = (unsigned long long)ceil(p * h->n);
+    unsigned long long seen = 0;
+    for (int us = 0; us < HIST_US; us++) {
+        seen += h->count[us];
+        if (seen >= want) {
+            return us + 1 < h->max_ns / 1000.0 ? us + 1 : h->max_ns / 1000.0;
+        }
+    }
+    return h->max_ns / 1000.0;
+}
+
+static void print_latency(const char *what, const Histogram *h) {
+    if (h->n == 0) {
+        fprintf(stderr, "%s: no quanta\n", what);
+        return;
+    }
+    fprintf(stderr, "%s latency (us): p50 %.0f  p99 %.0f  p99.9 %.0f  max %.0f  over %llu quanta\n", what,
+            percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999), h->max_ns / 1000.0, h->n);
+}
+
+static void futex_wait(_Atomic unsigned int *addr, unsigned int value) {
+    syscall(SYS_futex, (unsigned int *)addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic unsigned int *addr) {
+    syscall(SYS_futex, (unsigned int *)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Reader side: publish the slot just filled, waking the mixer if it went to sleep.
+static void ring_publish(Spsc *q, unsigned int head) {
+    atomic_store(&q->head, head + 1);
+    if (atomic_load(&q->waiting)) {
+        atomic_store(&q->waiting, 0);
+        futex_wake(&q->head);
+    }
+}
+
+// Mixer side: wait until the reader has published past tail.
+static void ring_wait(Spsc *q, unsigned int tail) {
+    for (int spin = 0; spin < SPIN_LIMIT; spin++) {
+        if (atomic_load_explicit(&q->head, memory_order_acquire) != tail) {
+            return;
+        }
+        cpu_relax();
+    }
+    while (1) {
+        atomic_store(&q->waiting, 1);
+        unsigned int head = atomic_load(&q->head);
+        if (head != tail) {
+            atomic_store(&q->waiting, 0);
+            return;
+        }
+        futex_wait(&q->head, head);
+    }
+}
+
+/*
+ * Read exactly len bytes unless the stream ends or, if stoppable, is stopped. Each read then waits
+ * in poll on the wake pipe as well, so a stop ends it even when no more input is coming.
+ * Returns the bytes read.
+ */
+static size_t read_full(int fd, unsigned char *buf, size_t len, int stoppable) {
+    struct pollfd fds[2] = {{.fd = fd, .events = POLLIN}, {.fd = wake_pipe[0], .events = POLLIN}};
+    size_t got = 0;
+    while (got < len && !(stoppable && stopped())) {
+        if (poll(fds, stoppable ? 2 : 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (stoppable && fds[1].revents != 0) {
+            break;
+        }
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r > 0) {
+            got += r;
+        } else if (r == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    return got;
+}
+
+// Write all of buf, through partial writes. Returns 0, or -1 if the destination went away.
+static int write_full(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/*
+ * Reader thread: fill one quantum at a time and publish it. Only whole frames are passed on;
+ * the last slot published has samples 0. Signals are taken on this thread rather than the
+ * mixer's; either way the wake pipe gets a blocked read out once the stream stops.
+ */
+static void *reader_main(void *arg) {
+    Live *live = arg;
+    Spsc *q = &live->ring;
+    const size_t want = (size_t)live->quantum * live->info.block_align;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t got = want;
+    while (got == want) {
+        if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == RING_SLOTS) {
+            atomic_fetch_add(&q->full, 1);
+            while (head - atomic_load_explicit(&q->tail, memory_order_acquire) == RING_SLOTS) {
+                sched_yield();
+            }
+        }
+        Slot *slot = &q->slots[head % RING_SLOTS];
+        got = read_full(live->in_fd, slot->data, want, 1);
+        slot->arrival = now_ns();
+        slot->samples = got / live->info.block_align * live->info.channels;
+        if (slot->samples > 0) {
+            ring_publish(q, head++);
+        }
+    }
+
+    while (head - atomic_load_explicit(&q->tail, memory_order_acquire) == RING_SLOTS) {
+        sched_yield();
+    }
+    q->slots[head % RING_SLOTS].samples = 0;
+    ring_publish(q, head);
+    return NULL;
+}
+
+/*
+ * Mix a quantum in place through the echo ring: 16-bit single echoes and float as they lie,
+ * other PCM through the work buffer. in == NULL mixes silence for the tail.
+ */
+static int mix_quantum(Live *live, unsigned char *data, int in_silence, size_t samples) {
+    const WavInfo *info = &live->info;
+    if (live->echo.type == ECHO_S16 || info->sample_type == WAV_F32) {
+        return echo_mix(&live->echo, in_silence ? NULL : data, data, samples);
+    }
+    if (!in_silence) {
+        wav_decode(info, data, live->work, samples);
+    }
+    int mixed = echo_mix(&live->echo, in_silence ? NULL : live->work, live->work, samples);
+    wav_encode(info, live->work, data, samples);
+    return mixed;
+}
+
+/*
+ * Mixer: take each quantum as soon as it is published, mix it and write it straight out,
+ * then drain the echo tail once the stream ends. The destination gets a streaming header,
+ * since its length is not known until the end. Returns 0, or -1 on failure.
+ */
+static int run_live(Live *live) {
+    const WavInfo *info = &live->info;
+    Spsc *q = &live->ring;
+
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, info, WAV_SIZE_UNKNOWN);
+    if (write_full(live->out_fd, header, WAV_HEADER_BYTES) == -1) {
+        perror("liveecho: write");
+        return -1;
+    }
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_main, live) != 0) {
+        fprintf(stderr, "Could not start the reader thread\n");
+        return -1;
+    }
+
+    int result = 0;
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1) {
+        ring_wait(q, tail);
+        Slot *slot = &q->slots[tail % RING_SLOTS];
+        size_t samples = slot->samples;
+        if (samples == 0) {
+            break;
+        }
+        if (result == 0) {
+            if (mix_quantum(live, slot->data, 0, samples) == -1
+                || write_full(live->out_fd, slot->data, samples * info->sample_bytes) == -1) {
+                // Keep taking quanta so the reader is not left blocked on a full ring
+                perror("liveecho: write");
+                result = -1;
+                stop_stream();
+            } else {
+                record(&live->latency, now_ns() - slot->arrival);
+            }
+        }
+        atomic_store_explicit(&q->tail, ++tail, memory_order_release);
+    }
+    pthread_join(reader, NULL);
+
+    // Drain the echo tail a quantum at a time, into the slot that ended the stream
+    unsigned char *spare = q->slots[tail % RING_SLOTS].data;
+    const size_t quantum_samples = (size_t)live->quantum * info->channels;
+    for (size_t done = 0; result == 0 && done < (size_t)live->echo.delay; done += quantum_samples) {
+        size_t n = live->echo.delay - done < quantum_samples ? live->echo.delay - done : quantum_samples;
+        if (mix_quantum(live, spare, 1, n) == -1 || write_full(live->out_fd, spare, n * info->sample_bytes) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Generator thread for -L: a 440 Hz tone, one quantum every quantum period, on an absolute clock.
+static void *source_main(void *arg) {
+    Loopback *lb = arg;
+    const WavInfo *info = &lb->info;
+    const size_t samples = (size_t)lb->quantum * info->channels;
+    short *quantum = malloc(samples * sizeof(short));
+    if (quantum == NULL) {
+        fprintf(stderr, "Memory allocation failed for quantum\n");
+        close(lb->source_fd);
+        return NULL;
+    }
+
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, info, WAV_SIZE_UNKNOWN);
+    write_full(lb->source_fd, header, WAV_HEADER_BYTES);
+
+    const long long period = 1000000000LL * lb->quantum / info->sample_rate;
+    const long long start = now_ns();
+    double phase = 0;
+    for (long long k = 0; k < lb->quanta && !stopped(); k++) {
+        for (int i = 0; i < lb->quantum; i++) {
+            for (int c = 0; c < info->channels; c++) {
+                quantum[i * info->channels + c] = 8000 * sin(phase);
+            }
+            phase += 2 * M_PI * 440 / info->sample_rate;
+        }
+
+        long long due = start + k * period;
+        struct timespec ts = {due / 1000000000LL, due % 1000000000LL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        atomic_store_explicit(&lb->sent[k % SENT_SLOTS], now_ns(), memory_order_relaxed);
+        if (write_full(lb->source_fd, (unsigned char *)quantum, samples * sizeof(short)) == -1) {
+            break;
+        }
+    }
+    free(quantum);
+    close(lb->source_fd);
+    return NULL;
+}
+
+// Sink thread for -L: time every quantum that comes back against when it was sent.
+static void *sink_main(void *arg) {
+    Loopback *lb = arg;
+    const size_t bytes = (size_t)lb->quantum * lb->info.block_align;
+    const long long period = 1000000000LL * lb->quantum / lb->info.sample_rate;
+    unsigned char *quantum = malloc(bytes > WAV_HEADER_BYTES ? bytes : WAV_HEADER_BYTES);
+    if (quantum == NULL || read_full(lb->sink_fd, quantum, WAV_HEADER_BYTES, 0) != WAV_HEADER_BYTES) {
+        free(quantum);
+        return NULL;
+    }
+
+    // Quanta past the last one sent are the echo tail. A stop does not end this: the mixer still
+    // writes the tail, and would block on a full socket if nothing read it, so read until it closes.
+    // Timing ends at the stop, as from there on what comes back was not all sent.
+    for (long long k = 0; read_full(lb->sink_fd, quantum, bytes, 0) == bytes; k++) {
+        if (k < lb->quanta && !stopped()) {
+            long long latency = now_ns() - atomic_load_explicit(&lb->sent[k % SENT_SLOTS], memory_order_relaxed);
+            record(&lb->latency, latency);
+            lb->late += latency > period;
+        }
+    }
+    free(quantum);
+    return NULL;
+}
+
+/*
+ * Open one end of the stream: "-" is standard input or output, "unix:PATH" is a Unix stream
+ * socket (the source listens on PATH for one connection, the destination connects to it), and
+ * anything else is a path, such as a FIFO. Returns the fd, or -1 after printing why.
+ */
+static int open_end(const char *spec, int is_source) {
+    if (strcmp(spec, "-") == 0) {
+        return dup(is_source ? STDIN_FILENO : STDOUT_FILENO);
+    }
+    if (strncmp(spec, "unix:", 5) != 0) {
+        int fd = is_source ? open(spec, O_RDONLY) : open(spec, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            fprintf(stderr, "Invalid File: %s\n", spec);
+        }
+        return fd;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(spec + 5) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket Path Too Long: %s\n", spec + 5);
+        return -1;
+    }
+    strcpy(addr.sun_path, spec + 5);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (!is_source) {
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror(spec);
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+        perror(spec);
+        close(sock);
+        return -1;
+    }
+    int fd = accept(sock, NULL, NULL);
+    if (fd == -1) {
+        perror("accept");
+    }
+    close(sock);
+    unlink(addr.sun_path);
+    return fd;
+}
+
+/*
+ * Read the source's header, then allocate the ring slots and echo for its format.
+ * Returns 0, or -1 after printing why.
+ */
+static int start_live(Live *live, const EchoTap *frame_taps, int ntaps, int feedback, int saturate) {
+    FILE *in = fdopen(dup(live->in_fd), "rb");
+    if (in == NULL) {
+        perror("fdopen");
+        return -1;
+    }
+    // Unbuffered, so nothing past the header is read ahead of the reader thread
+    setvbuf(in, NULL, _IONBF, 0);
+    int err = wav_read_header(in, &live->info);
+    fclose(in);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+        return -1;
+    }
+
+    const WavInfo *info = &live->info;
+    EchoTap taps[ECHO_MAX_TAPS];
+    for (int k = 0; k < ntaps; k++) {
+        if (frame_taps[k].delay > 2147483647 / info->channels) {
+            fprintf(stderr, "Delay Too Large for %d Channels\n", info->channels);
+            return -1;
+        }
+        taps[k].delay = frame_taps[k].delay * info->channels;
+        taps[k].volume_scale = frame_taps[k].volume_scale;
+    }
+    int type = info->sample_type == WAV_S16 && ntaps == 1 && feedback == 0 ? ECHO_S16
+             : info->sample_type == WAV_F32 ? ECHO_F32 : ECHO_S32;
+    if (echo_init_taps(&live->echo, type, info->bits_per_sample, taps, ntaps, feedback, saturate, 0) == -1) {
+        fprintf(stderr, "Memory allocation failed for echo_buffer\n");
+        return -1;
+    }
+
+    // One allocation for every slot; ints are the widest sample, packed or unpacked
+    const size_t samples = (size_t)live->quantum * info->channels;
+    unsigned char *slots = malloc(RING_SLOTS * samples * sizeof(int));
+    live->work = malloc(samples * sizeof(int));
+    if (slots == NULL || live->work == NULL) {
+        fprintf(stderr, "Memory allocation failed for ring\n");
+        free(slots);
+        return -1;
+    }
+    for (int i = 0; i < RING_SLOTS; i++) {
+        live->ring.slots[i].data = slots + i * samples * sizeof(int);
+    }
+    return 0;
+}
+
+static int parse_positive(const char *arg, const char *what) {
+    char *err;
+    long value = strtol(arg, &err, 10);
+    if (*err != '\0' || value <= 0 || value > 2147483647) {
+        fprintf(stderr, "%s Must Be a Positive 32-bit Integer\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    EchoTap taps[ECHO_MAX_TAPS];
+    int ndelays = 0;
+    int nvolume_scales = 0;
+    int feedback = 0;
+    int saturate = 0;
+    int quantum = DEFAULT_QUANTUM;
+    double loop_seconds = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:v:f:sq:L:")) != -1) {
+        switch (opt) {
+            case 'd':
+            case 'v':
+                if ((opt == 'd' ? ndelays : nvolume_scales) == ECHO_MAX_TAPS) {
+                    fprintf(stderr, "At Most %d Taps Can Be Given\n", ECHO_MAX_TAPS);
+                    exit(EXIT_FAILURE);
+                }
+                if (opt == 'd') {
+                    taps[ndelays++].delay = parse_positive(optarg, "Delay Parameter");
+                } else {
+                    taps[nvolume_scales++].volume_scale = parse_positive(optarg, "Volume Parameter");
+                }
+                break;
+            case 'f':
+                feedback = parse_positive(optarg, "Feedback Parameter");
+                break;
+            case 's':
+                saturate = 1;
+                break;
+            case 'q':
+                quantum = parse_positive(optarg, "Quantum");
+                break;
+            case 'L':
+                loop_seconds = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d delay] [-v volume_scale] ... [-f feedback] [-s] [-q quantum_frames] src dest\n"
+                                "       %s [options] -L seconds\n"
+                                "src and dest are - (standard input or output), unix:PATH (a Unix socket) or a path such as a FIFO\n",
+                        argv[0], argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (quantum > 4096) {
+        fprintf(stderr, "Quantum Must Be At Most 4096 Frames\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((loop_seconds <= 0 && optind + 2 != argc) || (loop_seconds > 0 && optind != argc)) {
+        fprintf(stderr, "Empty File Parameter(s)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int ntaps = ndelays > nvolume_scales ? ndelays : nvolume_scales;
+    ntaps = ntaps == 0 ? 1 : ntaps;
+    for (int k = 0; k < ntaps; k++) {
+        taps[k].delay = k < ndelays ? taps[k].delay : 8000;
+        taps[k].volume_scale = k < nvolume_scales ? taps[k].volume_scale : 4;
+    }
+
+    // Signals are only taken on the reader thread (see reader_main); a closed destination is an error, not a kill
+    if (pipe(wake_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK); // Never blocks the signal handler
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    Live *live = calloc(1, sizeof(Live));
+    Loopback *lb = NULL;
+    if (live == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    live->quantum = quantum;
+
+    pthread_t source, sink;
+    if (loop_seconds > 0) {
+        lb = calloc(1, sizeof(Loopback));
+        int in_pair[2], out_pair[2];
+        if (lb == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, in_pair) == -1
+            || socketpair(AF_UNIX, SOCK_STREAM, 0, out_pair) == -1) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        // 16-bit stereo at 44.1 kHz, like the other tools' test sources
+        lb->info.format = WAV_FORMAT_PCM;
+        lb->info.sample_type = WAV_S16;
+        lb->info.channels = 2;
+        lb->info.sample_rate = 44100;
+        lb->info.bits_per_sample = 16;
+        lb->info.sample_bytes = 2;
+        lb->info.block_align = 4;
+        lb->quantum = quantum;
+        lb->quanta = (long long)(loop_seconds * lb->info.sample_rate / quantum);
+        lb->source_fd = in_pair[0];
+        lb->sink_fd = out_pair[1];
+        live->in_fd = in_pair[1];
+        live->out_fd = out_pair[0];
+        if (pthread_create(&source, NULL, source_main, lb) != 0
+            || pthread_create(&sink, NULL, sink_main, lb) != 0) {
+            fprintf(stderr, "Could not start the loopback threads\n");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        live->in_fd = open_end(argv[optind], 1);
+        live->out_fd = live->in_fd == -1 ? -1 : open_end(argv[optind + 1], 0);
+        if (live->out_fd == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (start_live(live, taps, ntaps, feedback, saturate) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "quantum: %d frames (%.2f ms), kernel: %s\n", quantum,
+            1000.0 * quantum / live->info.sample_rate, echo_kernel_name());
+
+    int result = run_live(live);
+    close(live->in_fd);
+    close(live->out_fd);
+
+    print_latency("arrival to output", &live->latency);
+    fprintf(stderr, "ring full: %lu times\n", atomic_load(&live->ring.full));
+    if (lb != NULL) {
+        pthread_join(source, NULL);
+        pthread_join(sink, NULL);
+        close(lb->sink_fd);
+        print_latency("end-to-end", &lb->latency);
+        fprintf(stderr, "late (over one quantum): %lld\n", lb->late);
+        free(lb);
+    }
+
+    echo_free(&live->echo);
+    free(live->ring.slots[0].data);
+    free(live->work);
+    free(live);
+    return result == 0 ? 0 : 1;
+}
@@ -1,59 +1,612 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-int main(int argc, char **argv) {
-    
-    if ( argc != 3) {
-        fprintf(stderr, "Invalid Command Line Arguments.\n");
+#include "batch.h"
+#include "blockio.h"
+#include "vocals.h"
+#include "wav.h"
+
+#define BLOCK_FRAMES 32768 // Stereo frames per read/write block on the stdio path
+#define CHUNK_FRAMES 262144 // Stereo frames each worker thread handles at a time with -j
+#define ASYNC_FRAMES 131072 // Stereo frames per queued read and write with -A
+
+/*
+ * A source file mapped read-only, with its parsed header.
+ */
+typedef struct source {
+    unsigned char *map;
+    size_t size;
+    WavInfo info;
+    size_t frames;          // Whole stereo frames in the data chunk
+} Source;
+
+/*
+ * Shared state for -j: workers claim the next chunk of frames under lock, then
+ * process it from the mapped source and pwrite it to the same offset in the destination.
+ */
+typedef struct job {
+    const Source *src;
+    int dest_fd;
+    int quality;
+    size_t next_frame;      // First frame of the next unclaimed chunk
+    int failed;
+    pthread_mutex_t lock;
+} Job;
+
+/*
+ * Everything needed to process one file. In batch mode each worker thread owns one,
+ * so the block buffers are allocated once and reused for every file.
+ */
+typedef struct worker {
+    int threads;
+    int use_stdio;
+    int quality;
+    int async_depth;            // Blocks kept in flight by the queued I/O path, 0 to map instead
+    unsigned char *block;       // BLOCK_FRAMES frames read on the stdio path
+    void *work;                 // BLOCK_FRAMES stereo ints for unpacking 8, 24 and 32-bit PCM
+} Worker;
+
+/*
+ * Remove the vocals from frames of the file's format, from in to out (in may equal out).
+ * first_frame is where in starts in the file, which places the dither noise.
+ * 16-bit and aligned float frames are processed where they lie; 8, 24 and 32-bit PCM are
+ * unpacked into work (BLOCK_FRAMES stereo ints) and packed again afterwards.
+ * Float samples are already exact, so quality only changes integer PCM.
+ */
+void process_frames(const WavInfo *info, const unsigned char *in, unsigned char *out,
+                    size_t frames, size_t first_frame, int quality, void *work) {
+    if (info->sample_type == WAV_S16) {
+        if (quality == VOCALS_TRUNCATE) {
+            remove_vocals((const short *)in, (short *)out, frames);
+        } else {
+            remove_vocals_rounded((const short *)in, (short *)out, frames, first_frame,
+                                  quality == VOCALS_DITHER);
+        }
+        return;
+    }
+    if (info->sample_type == WAV_F32 && ((size_t)in | (size_t)out) % sizeof(float) == 0) {
+        remove_vocals_f32((const float *)in, (float *)out, frames);
+        return;
+    }
+
+    for (size_t done = 0; done < frames; ) {
+        size_t n = frames - done < BLOCK_FRAMES ? frames - done : BLOCK_FRAMES;
+        const unsigned char *src = in + done * info->block_align;
+        unsigned char *dest = out + done * info->block_align;
+
+        if (info->sample_type == WAV_F32) {
+            memcpy(work, src, n * info->block_align);
+            remove_vocals_f32(work, work, n);
+            memcpy(dest, work, n * info->block_align);
+        } else {
+            wav_decode(info, src, work, n * 2);
+            if (quality == VOCALS_TRUNCATE) {
+                remove_vocals_s32(work, work, n);
+            } else {
+                remove_vocals_rounded_s32(work, work, n, first_frame + done, quality == VOCALS_DITHER,
+                                          info->bits_per_sample);
+            }
+            wav_encode(info, work, dest, n * 2);
+        }
+        done += n;
+    }
+}
+
+// Returns 0 if info describes audio remvocals can process, otherwise prints why and returns -1.
+int check_stereo(const WavInfo *info) {
+    if (info->channels != 2) {
+        fprintf(stderr, "Source Must Be a Stereo WAV File (it has %d channels)\n", info->channels);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Map src_fd and parse its header. Returns 0 on success, 1 if the file cannot be mapped
+ * (the caller falls back to stdio), and -1 if it is not a usable WAV file.
+ */
+int map_source(int src_fd, Source *src) {
+    struct stat src_stat;
+
+    if (fstat(src_fd, &src_stat) == -1 || !S_ISREG(src_stat.st_mode) || src_stat.st_size == 0) {
         return 1;
     }
 
-    FILE *source_file = fopen(argv[1], "rb");
-    FILE *dest_file = fopen(argv[2], "wb+");
+    src->size = src_stat.st_size;
+    src->map = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+    if (src->map == MAP_FAILED) {
+        return 1;
+    }
+    madvise(src->map, src->size, MADV_SEQUENTIAL);
+
+    int err = wav_parse_buffer(src->map, src->size, &src->info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+    }
+    if (err != 0 || check_stereo(&src->info) == -1) {
+        munmap(src->map, src->size);
+        return -1;
+    }
+
+    // A trailing partial frame is dropped, as on the stdio path
+    src->frames = src->info.data_size / src->info.block_align;
+    return 0;
+}
+
+// Size of the output file for src: canonical header, the same frames, and a pad byte if odd.
+size_t dest_size(const Source *src) {
+    size_t data_size = src->frames * src->info.block_align;
+    return WAV_HEADER_BYTES + data_size + (data_size & 1);
+}
 
-    if (source_file == NULL || dest_file == NULL) { //Checking if files were successfully opened.
-        fprintf(stderr, "Invalid File(s)\n");
+int is_regular(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/*
+ * Zero-copy path for regular files: the source is mapped read-only, the destination is
+ * sized up front and mapped shared, and frames go straight from one map into the other.
+ * Returns 0 on success, 1 if either file cannot be mapped (the caller falls back to stdio),
+ * and -1 on a hard error.
+ */
+int remvocals_mapped(Worker *w, int src_fd, int dest_fd) {
+    Source src;
+
+    if (!is_regular(dest_fd)) {
         return 1;
     }
-    // Copy pasting the first 44 bytes, the header of the .wav file.
-    char *buff = malloc(44);
-    fread(buff, 44, 1, source_file);
-    fwrite(buff, 44, 1, dest_file);
-    free(buff);
+    int result = map_source(src_fd, &src);
+    if (result != 0) {
+        return result;
+    }
 
-    short number_read;
-    short left;
-    short result;
-    int r;
-    // Creating a variable to keep track of which of the pair of shorts is being read in:
-    int first = 1;
+    // Reserve the blocks for the whole output; ftruncate still works where fallocate is unsupported
+    size_t size = dest_size(&src);
+    unsigned char *dest = MAP_FAILED;
+    if (posix_fallocate(dest_fd, 0, size) == 0 || ftruncate(dest_fd, size) == 0) {
+        dest = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dest_fd, 0);
+    }
+    if (dest == MAP_FAILED) {
+        munmap(src.map, src.size);
+        return 1;
+    }
+    madvise(dest, size, MADV_SEQUENTIAL);
 
-    while ((r = fread(&number_read, sizeof(short), 1, source_file))) {
-        if (!(first % 2)) {
-            // If first is even that means from a pair of shorts, this is the second reading.
-            // *number_read is right.
-            
-            result = (left - number_read) / 2;
+    wav_make_header(dest, &src.info, src.frames * src.info.block_align);
+    process_frames(&src.info, src.map + src.info.data_offset, dest + WAV_HEADER_BYTES, src.frames,
+                   0, w->quality, w->work);
 
-            fwrite(&result, sizeof(short), 1, dest_file);
-            fwrite(&result, sizeof(short), 1, dest_file);
-            
-            first = 1;
+    munmap(src.map, src.size);
+    if (munmap(dest, size) == -1) {
+        perror("munmap");
+        return -1;
+    }
+    return 0;
+}
+
+// pwrite until count bytes are written. Returns 0 on success, -1 on error.
+int full_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    while (count > 0) {
+        ssize_t r = pwrite(fd, buf, count, offset);
+        if (r <= 0) {
+            return -1;
         }
-        else {
-            // *number_read is left
-            left = number_read;
-            first = 0;
+        buf = (const char *)buf + r;
+        count -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+void *remvocals_worker(void *arg) {
+    Job *job = arg;
+    const WavInfo *info = &job->src->info;
+    unsigned char *block = malloc((size_t)CHUNK_FRAMES * info->block_align);
+    void *work = malloc(BLOCK_FRAMES * 2 * sizeof(int));
+    int failed = block == NULL || work == NULL;
+
+    while (!failed) {
+        pthread_mutex_lock(&job->lock);
+        size_t first = job->next_frame;
+        size_t left = job->src->frames - first;
+        size_t frames = left < CHUNK_FRAMES ? left : CHUNK_FRAMES;
+        job->next_frame += frames;
+        int stop = job->failed;
+        pthread_mutex_unlock(&job->lock);
+
+        if (frames == 0 || stop) {
+            break;
+        }
+
+        // Chunks start on frame boundaries, at the same data offset in both files
+        size_t offset = first * info->block_align;
+        process_frames(info, job->src->map + info->data_offset + offset, block, frames, first,
+                       job->quality, work);
+        if (full_pwrite(job->dest_fd, block, frames * info->block_align,
+                        WAV_HEADER_BYTES + offset) == -1) {
+            failed = 1;
         }
     }
 
+    if (failed) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(work);
+    free(block);
+    return NULL;
+}
 
-    int error_1 = fclose(source_file);
-    int error_2 = fclose(dest_file);
+/*
+ * -j path for regular files: the sample region is split into frame-aligned chunks that
+ * threads workers process independently, so the output is byte-identical to a sequential run.
+ * Returns 0 on success, 1 if either file is not a regular file (the caller falls back), and -1 on error.
+ */
+int remvocals_threaded(Worker *w, int src_fd, int dest_fd) {
+    Source src;
 
-    if (error_1 || error_2) {
-        fprintf(stderr, "fclose failed\n");
+    if (!is_regular(dest_fd)) {
         return 1;
     }
+    int result = map_source(src_fd, &src);
+    if (result != 0) {
+        return result;
+    }
+
+    Job job;
+    job.src = &src;
+    job.dest_fd = dest_fd;
+    job.quality = w->quality;
+    job.next_frame = 0;
+    job.failed = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    // The pad byte (if any) comes from ftruncate's zero fill
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &src.info, src.frames * src.info.block_align);
+    if (ftruncate(dest_fd, dest_size(&src)) == -1
+        || full_pwrite(dest_fd, header, WAV_HEADER_BYTES, 0) == -1) {
+        perror("remvocals");
+        munmap(src.map, src.size);
+        return -1;
+    }
+
+    int threads = w->threads;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Memory allocation failed for workers\n");
+        munmap(src.map, src.size);
+        return -1;
+    }
+
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, remvocals_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        // Could not start any thread, so do the work on this one
+        remvocals_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+    munmap(src.map, src.size);
+
+    if (job.failed) {
+        fprintf(stderr, "remvocals: failed to process all frames\n");
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// Where blockio_copy's blocks are processed, in file order.
+typedef struct vocal_blocks {
+    const WavInfo *info;
+    int quality;
+    void *work;
+    size_t frame;           // First frame of the next block, which places the dither
+} VocalBlocks;
+
+int process_block(void *state, unsigned char *block, size_t bytes) {
+    VocalBlocks *blocks = state;
+    size_t frames = bytes / blocks->info->block_align;
+    process_frames(blocks->info, block, block, frames, blocks->frame, blocks->quality, blocks->work);
+    blocks->frame += frames;
+    return 0;
+}
+
+/*
+ * Queued asynchronous path for regular files (-A): reads and writes are issued ahead through
+ * io_uring (or POSIX AIO), async_depth blocks at a time, so the kernels never wait on the disk.
+ * Prints the backend, queue depth and bandwidth.
+ * Returns 0 on success, 1 if either file is not a regular file (the caller falls back), and -1 on error.
+ */
+int remvocals_async(Worker *w, int src_fd, int dest_fd) {
+    if (!is_regular(src_fd) || !is_regular(dest_fd)) {
+        return 1;
+    }
+
+    WavInfo info;
+    int err = wav_read_header_fd(src_fd, &info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+        return -1;
+    }
+    if (check_stereo(&info) == -1) {
+        return -1;
+    }
+
+    // The pad byte (if any) comes from ftruncate's zero fill
+    size_t frames = info.data_size / info.block_align;
+    size_t data_size = frames * info.block_align;
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &info, data_size);
+    if (ftruncate(dest_fd, WAV_HEADER_BYTES + data_size + (data_size & 1)) == -1
+        || full_pwrite(dest_fd, header, WAV_HEADER_BYTES, 0) == -1) {
+        perror("remvocals");
+        return -1;
+    }
+
+    VocalBlocks blocks = {&info, w->quality, w->work, 0};
+    BlockioStats stats;
+    if (blockio_copy(src_fd, info.data_offset, dest_fd, WAV_HEADER_BYTES, data_size,
+                     (size_t)ASYNC_FRAMES * info.block_align, w->async_depth, process_block, &blocks,
+                     &stats) == -1) {
+        return -1;
+    }
+    printf("io: %s, queue depth %d (%.1f requests in flight on average), %.1f MB/s\n", stats.backend,
+           stats.depth, stats.average_in_flight, stats.seconds > 0 ? stats.bytes / 1e6 / stats.seconds : 0);
+    return 0;
+}
+
+/*
+ * Fallback path for pipes and anything else that cannot be mapped.
+ * Returns 0 on success and -1 on failure.
+ */
+int remvocals_stdio(Worker *w, FILE *source_file, FILE *dest_file) {
+    WavInfo info;
+    int err = wav_read_header(source_file, &info);
+    if (err != 0) {
+        fprintf(stderr, "Invalid WAV File: %s\n", wav_strerror(err));
+        return -1;
+    }
+    if (check_stereo(&info) == -1) {
+        return -1;
+    }
+
+    size_t remaining = info.data_size == WAV_SIZE_UNKNOWN ? (size_t)-1 : info.data_size / info.block_align;
+
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &info, info.data_size == WAV_SIZE_UNKNOWN ? WAV_SIZE_UNKNOWN
+                                                                       : remaining * info.block_align);
+    fwrite(header, WAV_HEADER_BYTES, 1, dest_file);
+
+    // Read whole frames; a trailing partial frame is dropped
+    size_t written = 0;
+    size_t r;
+    while (remaining > 0) {
+        size_t want = remaining < BLOCK_FRAMES ? remaining : BLOCK_FRAMES;
+        if ((r = fread(w->block, info.block_align, want, source_file)) == 0) {
+            break;
+        }
+        process_frames(&info, w->block, w->block, r, written, w->quality, w->work);
+        fwrite(w->block, info.block_align, r, dest_file);
+        remaining -= r;
+        written += r;
+    }
+
+    // Chunks are word aligned, so an odd-sized data chunk gets a pad byte
+    if (written * info.block_align % 2) {
+        fputc(0, dest_file);
+    }
+    return 0;
+}
+
+/*
+ * Remove the vocals from one file: split it across threads with -j, queue the I/O with -A,
+ * otherwise map both files when we can, and stream them through stdio when none of those works.
+ * Matches BatchFn. Returns 0 on success and 1 on failure.
+ */
+int remvocals_file(void *worker, const char *src_path, const char *dest_path) {
+    Worker *w = worker;
+
+    int src_fd = open(src_path, O_RDONLY);
+    if (src_fd == -1) { //Checking if files were successfully opened.
+        fprintf(stderr, "Invalid File: %s\n", src_path);
+        return 1;
+    }
+    int dest_fd = open(dest_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (dest_fd == -1) {
+        fprintf(stderr, "Invalid File: %s\n", dest_path);
+        close(src_fd);
+        return 1;
+    }
+
+    int result = 1;
+    if (w->threads > 1) {
+        result = remvocals_threaded(w, src_fd, dest_fd);
+    }
+    if (result == 1 && !w->use_stdio && w->async_depth > 0) {
+        result = remvocals_async(w, src_fd, dest_fd);
+    }
+    if (result == 1 && !w->use_stdio) {
+        result = remvocals_mapped(w, src_fd, dest_fd);
+    }
+    if (result == 1) {
+        FILE *source_file = fdopen(src_fd, "rb");
+        FILE *dest_file = fdopen(dest_fd, "wb");
+        if (source_file == NULL || dest_file == NULL) {
+            perror("fdopen");
+            exit(1);
+        }
+
+        result = remvocals_stdio(w, source_file, dest_file);
+
+        int error_1 = fclose(source_file);
+        int error_2 = fclose(dest_file);
+
+        if (error_1 || error_2) {
+            fprintf(stderr, "fclose failed\n");
+            return 1;
+        }
+    } else {
+        close(src_fd);
+        if (close(dest_fd) == -1) {
+            fprintf(stderr, "close failed\n");
+            return 1;
+        }
+    }
+
+    return result == 0 ? 0 : 1;
+}
+
+// Allocate a worker's block buffers. Returns NULL if memory runs out.
+Worker *new_worker(int threads, int use_stdio, int quality, int async_depth) {
+    Worker *w = calloc(1, sizeof(Worker));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->threads = threads;
+    w->use_stdio = use_stdio;
+    w->quality = quality;
+    w->async_depth = async_depth;
+
+    // Frames are at most two 4-byte samples, packed or unpacked
+    w->block = malloc(BLOCK_FRAMES * 2 * sizeof(int));
+    w->work = malloc(BLOCK_FRAMES * 2 * sizeof(int));
+    if (w->block == NULL || w->work == NULL) {
+        free(w->block);
+        free(w->work);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void free_worker(Worker *w) {
+    free(w->block);
+    free(w->work);
+    free(w);
+}
+
+int main(int argc, char **argv) {
+
+    extern char *optarg;
+    extern int optind;
+
+    int use_stdio = 0;
+    int quality = VOCALS_TRUNCATE;
+    int threads = 1;
+    int async_depth = 0;
+    char *batch_input = NULL;
+    char *out_dir = ".";
+    int workers = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Sptj:A:B:o:w:")) != -1) {
+        char *err;
+        switch (opt) {
+            case 'S':
+                use_stdio = 1;
+                break;
+
+            case 'p':
+                quality = quality == VOCALS_DITHER ? VOCALS_DITHER : VOCALS_ROUND;
+                break;
+
+            case 't':
+                quality = VOCALS_DITHER;
+                break;
+
+            case 'j':
+                threads = strtol(optarg, &err, 10);
+                if (*err != '\0' || threads <= 0 || threads > 1024) {
+                    fprintf(stderr, "Thread Count Must Be an Integer From 1 to 1024\n");
+                    return 1;
+                }
+                break;
+
+            case 'A':
+                async_depth = strtol(optarg, &err, 10);
+                if (*err != '\0' || async_depth <= 0 || async_depth > 64) {
+                    fprintf(stderr, "Queue Depth Must Be an Integer From 1 to 64\n");
+                    return 1;
+                }
+                break;
+
+            case 'B':
+                batch_input = optarg;
+                break;
+
+            case 'o':
+                out_dir = optarg;
+                break;
+
+            case 'w':
+                workers = strtol(optarg, &err, 10);
+                if (*err != '\0' || workers <= 0 || workers > 1024) {
+                    fprintf(stderr, "Worker Count Must Be an Integer From 1 to 1024\n");
+                    return 1;
+                }
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-S] [-p | -t] [-j threads] [-A depth] src_file dest_file\n"
+                                "       %s [-S] [-p | -t] [-j threads] [-A depth] -B dir_or_manifest [-o out_dir] [-w workers]\n",
+                        argv[0], argv[0]);
+                return 1;
+        }
+    }
+
+    // Batch mode: many files over a pool of workers, each reusing its own buffers
+    if (batch_input != NULL) {
+        Worker **pool = malloc(workers * sizeof(Worker *));
+        if (pool == NULL) {
+            fprintf(stderr, "Memory allocation failed for workers\n");
+            return 1;
+        }
+        for (int i = 0; i < workers; i++) {
+            pool[i] = new_worker(threads, use_stdio, quality, async_depth);
+            if (pool[i] == NULL) {
+                fprintf(stderr, "Memory allocation failed for workers\n");
+                return 1;
+            }
+        }
+
+        int failed = batch_run(batch_input, out_dir, (void **)pool, workers, remvocals_file);
+
+        for (int i = 0; i < workers; i++) {
+            free_worker(pool[i]);
+        }
+        free(pool);
+        return failed == 0 ? 0 : 1;
+    }
+
+    if ((optind + 2) != argc) {
+        fprintf(stderr, "Invalid Command Line Arguments.\n");
+        return 1;
+    }
+
+    Worker *w = new_worker(threads, use_stdio, quality, async_depth);
+    if (w == NULL) {
+        fprintf(stderr, "Memory allocation failed for block\n");
+        return 1;
+    }
+
+    int result = remvocals_file(w, argv[optind], argv[optind + 1]);
+
+    free_worker(w);
+
+    return result;
+}
@@ -0,0 +1,208 @@
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "vocals.h"
+
+#define DITHER_FRAMES 4096 // Frames per dither seed, so the noise does not depend on how a file is split
+
+/*
+ * For every (left, right) pair, write (left - right) / 2 to both channels.
+ * There is one loop per working sample type; in and out may be the same buffer.
+ */
+void remove_vocals(const short *in, short *out, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        short left = in[2 * i];
+        short right = in[2 * i + 1];
+        short result = (left - right) / 2;
+
+        out[2 * i] = result;
+        out[2 * i + 1] = result;
+    }
+}
+
+void remove_vocals_s32(const int *in, int *out, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        int result = ((long long)in[2 * i] - in[2 * i + 1]) / 2;
+
+        out[2 * i] = result;
+        out[2 * i + 1] = result;
+    }
+}
+
+void remove_vocals_f32(const float *in, float *out, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        float result = (in[2 * i] - in[2 * i + 1]) / 2;
+
+        out[2 * i] = result;
+        out[2 * i + 1] = result;
+    }
+}
+
+/*
+ * Precise path. Every frame gets its own triangular noise value (the same in both channels,
+ * so they stay identical): the difference of two uniform values from one of four xorshift32
+ * lanes, frame j of a DITHER_FRAMES cell using lane j % 4. The lanes are seeded from the cell
+ * number, which makes the noise a function of the frame position alone.
+ */
+static unsigned int dither_seed(size_t cell, int lane) {
+    unsigned int h = (unsigned int)(cell * 4 + lane + 1) * 0x9E3779B1u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    return h != 0 ? h : 1;
+}
+
+static inline unsigned int xorshift(unsigned int *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static inline float tpdf(unsigned int *lane) {
+    float a = (float)(xorshift(lane) >> 8) * (1.0f / 16777216);
+    float b = (float)(xorshift(lane) >> 8) * (1.0f / 16777216);
+    return a - b;
+}
+
+// Round to nearest, ties to even, with the FPU's default mode (|v| < 2^22); this is what cvtps2dq does.
+static inline float round_even(float v) {
+    return (v + 12582912.0f) - 12582912.0f;
+}
+
+static inline double round_even_double(double v) {
+    return (v + 6755399441055744.0) - 6755399441055744.0;
+}
+
+static inline short round_s16(short left, short right, float noise) {
+    float v = round_even((float)(left - right) * 0.5f + noise);
+    return v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (short)v;
+}
+
+/*
+ * frames 16-bit frames starting at frame j of their dither cell. With SSE2, four frames
+ * (one per lane) are done at a time; the scalar frames around them give the same result.
+ */
+static void round_s16_frames(const short *in, short *out, size_t frames, size_t j,
+                             unsigned int *lanes, int dither) {
+    size_t i = 0;
+
+    // Scalar up to the next group of four, so lane k lines up with vector element k
+    for (; i < frames && (j + i) % 4 != 0; i++) {
+        float noise = dither ? tpdf(&lanes[(j + i) % 4]) : 0.0f;
+        short result = round_s16(in[2 * i], in[2 * i + 1], noise);
+        out[2 * i] = result;
+        out[2 * i + 1] = result;
+    }
+
+#ifdef __SSE2__
+    __m128i state = _mm_loadu_si128((const __m128i *)lanes);
+    const __m128 unit = _mm_set1_ps(1.0f / 16777216);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    for (; i + 4 <= frames; i += 4) {
+        // Each 32-bit element holds one frame: left in the low half, right in the high half
+        __m128i pair = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+        __m128i left = _mm_srai_epi32(_mm_slli_epi32(pair, 16), 16);
+        __m128i right = _mm_srai_epi32(pair, 16);
+        __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(left, right)), half);
+
+        if (dither) {
+            __m128 a, b;
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(state, 8)), unit);
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(state, 8)), unit);
+            v = _mm_add_ps(v, _mm_sub_ps(a, b));
+        }
+
+        // Round, saturate to 16 bits, and write each result to both channels
+        __m128i result = _mm_packs_epi32(_mm_cvtps_epi32(v), _mm_cvtps_epi32(v));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi16(result, result));
+    }
+    _mm_storeu_si128((__m128i *)lanes, state);
+#endif
+
+    for (; i < frames; i++) {
+        float noise = dither ? tpdf(&lanes[(j + i) % 4]) : 0.0f;
+        short result = round_s16(in[2 * i], in[2 * i + 1], noise);
+        out[2 * i] = result;
+        out[2 * i + 1] = result;
+    }
+}
+
+// The same for PCM unpacked to ints, in double so 32-bit samples stay exact.
+// Unpacked 16-bit samples are done in float, exactly as the shorts are.
+static void round_s32_frames(const int *in, int *out, size_t frames, size_t j,
+                             unsigned int *lanes, int dither, int bits) {
+    const double max = (double)((1LL << (bits - 1)) - 1);
+    const double min = -max - 1;
+
+    if (bits == 16) {
+        for (size_t i = 0; i < frames; i++) {
+            float noise = dither ? tpdf(&lanes[(j + i) % 4]) : 0.0f;
+            short result = round_s16(in[2 * i], in[2 * i + 1], noise);
+            out[2 * i] = result;
+            out[2 * i + 1] = result;
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < frames; i++) {
+        double noise = dither ? tpdf(&lanes[(j + i) % 4]) : 0.0f;
+        double v = round_even_double(((double)in[2 * i] - in[2 * i + 1]) * 0.5 + noise);
+        int result = v > max ? max : v < min ? min : v;
+        out[2 * i] = result;
+        out[2 * i + 1] = result;
+    }
+}
+
+/*
+ * Run frames (the first of which is frame first_frame of the file) through the precise path,
+ * one dither cell at a time. A run that starts partway into a cell first steps the lanes
+ * past the frames before it. bits is 0 for shorts.
+ */
+static void round_frames(const void *in, void *out, size_t frames, size_t first_frame, int dither,
+                         int bits) {
+    const int per_frame = bits == 0 ? 2 * sizeof(short) : 2 * sizeof(int);
+
+    for (size_t done = 0; done < frames; ) {
+        size_t frame = first_frame + done;
+        size_t j = frame % DITHER_FRAMES;
+        size_t n = DITHER_FRAMES - j < frames - done ? DITHER_FRAMES - j : frames - done;
+
+        unsigned int lanes[4];
+        for (int k = 0; k < 4; k++) {
+            lanes[k] = dither_seed(frame / DITHER_FRAMES, k);
+        }
+        for (size_t skip = 0; dither && skip < j; skip++) {
+            tpdf(&lanes[skip % 4]);
+        }
+
+        const char *src = (const char *)in + done * per_frame;
+        char *dest = (char *)out + done * per_frame;
+        if (bits == 0) {
+            round_s16_frames((const short *)src, (short *)dest, n, j, lanes, dither);
+        } else {
+            round_s32_frames((const int *)src, (int *)dest, n, j, lanes, dither, bits);
+        }
+        done += n;
+    }
+}
+
+void remove_vocals_rounded(const short *in, short *out, size_t frames, size_t first_frame,
+                           int dither) {
+    round_frames(in, out, frames, first_frame, dither, 0);
+}
+
+void remove_vocals_rounded_s32(const int *in, int *out, size_t frames, size_t first_frame,
+                               int dither, int bits) {
+    round_frames(in, out, frames, first_frame, dither, bits);
+}
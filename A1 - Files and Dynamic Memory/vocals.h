@@ -0,0 +1,29 @@
+#ifndef VOCALS_H
+#define VOCALS_H
+
+#include <stddef.h>
+
+// How the (left - right) / 2 result is brought back to the sample width
+#define VOCALS_TRUNCATE 0   // Integer division, wrapping on overflow: the original output
+#define VOCALS_ROUND 1      // Computed in float, rounded to nearest and saturated
+#define VOCALS_DITHER 2     // As VOCALS_ROUND, with TPDF dither of +-1 LSB added before rounding
+
+/*
+ * For every (left, right) pair of interleaved stereo frames, write (left - right) / 2 to
+ * both channels. in and out may be the same buffer.
+ */
+void remove_vocals(const short *in, short *out, size_t frames);
+void remove_vocals_s32(const int *in, int *out, size_t frames);
+void remove_vocals_f32(const float *in, float *out, size_t frames);
+
+/*
+ * The precise path: rounded and saturated, with dither if asked. first_frame is where in starts
+ * in the file; the noise depends only on the frame position, so a file can be split any way.
+ * The s32 variant takes PCM of bits bits unpacked to ints.
+ */
+void remove_vocals_rounded(const short *in, short *out, size_t frames, size_t first_frame,
+                           int dither);
+void remove_vocals_rounded_s32(const int *in, int *out, size_t frames, size_t first_frame,
+                               int dither, int bits);
+
+#endif
@@ -0,0 +1,312 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "wav.h"
+
+/*
+ * The chunk walk is shared between the in-memory and the stdio parser, so both read
+ * through this small cursor: mem is set for buffers, file for streams.
+ */
+typedef struct wav_source {
+    const unsigned char *mem;
+    size_t len;
+    FILE *file;
+    size_t pos;
+} WavSource;
+
+static unsigned int read_u16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int read_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void write_u16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void write_u32(unsigned char *p, unsigned int v) {
+    write_u16(p, v & 0xFFFF);
+    write_u16(p + 2, v >> 16);
+}
+
+// Read exactly n bytes. Returns 0, or -1 at end of input.
+static int source_read(WavSource *src, void *buf, size_t n) {
+    if (src->mem != NULL) {
+        if (src->len - src->pos < n) {
+            return -1;
+        }
+        memcpy(buf, src->mem + src->pos, n);
+    } else if (n > 0 && fread(buf, n, 1, src->file) != 1) {
+        return -1;
+    }
+    src->pos += n;
+    return 0;
+}
+
+// Skip n bytes. Streams are read and discarded so pipes work too.
+static int source_skip(WavSource *src, size_t n) {
+    if (src->mem != NULL) {
+        if (src->len - src->pos < n) {
+            return -1;
+        }
+        src->pos += n;
+        return 0;
+    }
+
+    unsigned char discard[4096];
+    while (n > 0) {
+        size_t step = n < sizeof(discard) ? n : sizeof(discard);
+        if (source_read(src, discard, step) == -1) {
+            return -1;
+        }
+        n -= step;
+    }
+    return 0;
+}
+
+static int parse_fmt(const unsigned char *body, size_t len, WavInfo *info) {
+    if (len < 16) {
+        return WAV_ERR_UNSUPPORTED;
+    }
+
+    unsigned int format = read_u16(body);
+    info->channels = read_u16(body + 2);
+    info->sample_rate = read_u32(body + 4);
+    info->block_align = read_u16(body + 12);
+    info->bits_per_sample = read_u16(body + 14);
+
+    // WAVE_FORMAT_EXTENSIBLE keeps the real format tag in the first two bytes of the sub-format GUID
+    if (format == WAV_FORMAT_EXTENSIBLE) {
+        if (len < 40) {
+            return WAV_ERR_UNSUPPORTED;
+        }
+        format = read_u16(body + 24);
+    }
+    info->format = format;
+    info->sample_bytes = info->bits_per_sample / 8;
+
+    if (info->channels == 0 || info->bits_per_sample % 8 != 0
+        || info->block_align != info->channels * info->sample_bytes) {
+        return WAV_ERR_UNSUPPORTED;
+    }
+
+    if (format == WAV_FORMAT_PCM) {
+        switch (info->bits_per_sample) {
+            case 8: info->sample_type = WAV_U8; return 0;
+            case 16: info->sample_type = WAV_S16; return 0;
+            case 24: info->sample_type = WAV_S24; return 0;
+            case 32: info->sample_type = WAV_S32; return 0;
+        }
+    } else if (format == WAV_FORMAT_FLOAT && info->bits_per_sample == 32) {
+        info->sample_type = WAV_F32;
+        return 0;
+    }
+    return WAV_ERR_UNSUPPORTED;
+}
+
+static int parse_chunks(WavSource *src, WavInfo *info) {
+    unsigned char riff[12];
+
+    if (source_read(src, riff, sizeof(riff)) == -1
+        || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        return WAV_ERR_NOT_RIFF;
+    }
+
+    int have_fmt = 0;
+    unsigned char chunk[8];
+    while (source_read(src, chunk, sizeof(chunk)) == 0) {
+        size_t size = read_u32(chunk + 4);
+
+        if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                return WAV_ERR_NO_FMT;
+            }
+            info->data_offset = src->pos;
+            info->data_size = size;
+            return 0;
+        }
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            unsigned char body[64];
+            size_t keep = size < sizeof(body) ? size : sizeof(body);
+            if (source_read(src, body, keep) == -1) {
+                return WAV_ERR_NO_FMT;
+            }
+            int err = parse_fmt(body, keep, info);
+            if (err != 0) {
+                return err;
+            }
+            have_fmt = 1;
+            size -= keep;
+        }
+
+        // Skip the rest of the chunk and its pad byte (chunks are word aligned)
+        if (source_skip(src, size + (size & 1)) == -1) {
+            break;
+        }
+    }
+    return have_fmt ? WAV_ERR_NO_DATA : WAV_ERR_NO_FMT;
+}
+
+int wav_parse_buffer(const void *buf, size_t len, WavInfo *info) {
+    WavSource src = {buf, len, NULL, 0};
+
+    int err = parse_chunks(&src, info);
+    if (err == 0 && info->data_size > len - info->data_offset) {
+        // Streaming headers (and truncated files) claim more than is there
+        info->data_size = len - info->data_offset;
+    }
+    return err;
+}
+
+int wav_read_header(FILE *f, WavInfo *info) {
+    WavSource src = {NULL, 0, f, 0};
+
+    return parse_chunks(&src, info);
+}
+
+int wav_read_header_fd(int fd, WavInfo *info) {
+    struct stat st;
+    int copy = fstat(fd, &st) == 0 ? dup(fd) : -1;
+    FILE *f = copy == -1 ? NULL : fdopen(copy, "rb");
+    if (f == NULL) {
+        if (copy != -1) {
+            close(copy);
+        }
+        return WAV_ERR_NOT_RIFF;
+    }
+
+    int err = wav_read_header(f, info);
+    fclose(f);
+    if (err == 0 && S_ISREG(st.st_mode) && info->data_size > (size_t)st.st_size - info->data_offset) {
+        info->data_size = st.st_size - info->data_offset;
+    }
+    return err;
+}
+
+const char *wav_strerror(int err) {
+    switch (err) {
+        case WAV_ERR_NOT_RIFF: return "not a RIFF/WAVE file";
+        case WAV_ERR_NO_FMT: return "missing fmt chunk";
+        case WAV_ERR_UNSUPPORTED: return "unsupported sample format";
+        case WAV_ERR_NO_DATA: return "missing data chunk";
+    }
+    return "no error";
+}
+
+void wav_make_header(unsigned char *header, const WavInfo *info, size_t data_size) {
+    // Sizes that do not fit in 32 bits are written as unknown, the same as a streaming header
+    unsigned int data = data_size > 0xFFFFFFFFu - 36 - 1 ? WAV_SIZE_UNKNOWN : data_size;
+    unsigned int riff = data == WAV_SIZE_UNKNOWN ? WAV_SIZE_UNKNOWN : 36 + data + (data & 1);
+
+    memcpy(header, "RIFF", 4);
+    write_u32(header + 4, riff);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write_u32(header + 16, 16);
+    write_u16(header + 20, info->format);
+    write_u16(header + 22, info->channels);
+    write_u32(header + 24, info->sample_rate);
+    write_u32(header + 28, info->sample_rate * info->block_align);
+    write_u16(header + 32, info->block_align);
+    write_u16(header + 34, info->bits_per_sample);
+    memcpy(header + 36, "data", 4);
+    write_u32(header + 40, data);
+}
+
+/*
+ * One tight loop per sample type; the switch is taken once per block, not once per sample.
+ */
+void wav_decode(const WavInfo *info, const void *raw, int *work, size_t samples) {
+    const unsigned char *in = raw;
+
+    switch (info->sample_type) {
+        case WAV_U8:
+            for (size_t i = 0; i < samples; i++) {
+                work[i] = in[i] - 128;
+            }
+            break;
+
+        case WAV_S16: {
+            // Little-endian like the tools' direct 16-bit paths; memcpy keeps it alignment-safe
+            size_t i = 0;
+#ifdef __SSE2__
+            for (; i + 8 <= samples; i += 8) {
+                __m128i x = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+                _mm_storeu_si128((__m128i *)(work + i), _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+                _mm_storeu_si128((__m128i *)(work + i + 4), _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+            }
+#endif
+            for (; i < samples; i++) {
+                short sample;
+                memcpy(&sample, in + 2 * i, sizeof(short));
+                work[i] = sample;
+            }
+            break;
+        }
+
+        case WAV_S24:
+            for (size_t i = 0; i < samples; i++) {
+                const unsigned char *p = in + 3 * i;
+                // Assemble in the top three bytes, then shift down to sign-extend
+                work[i] = (int)(((unsigned int)p[0] << 8) | ((unsigned int)p[1] << 16)
+                                | ((unsigned int)p[2] << 24)) >> 8;
+            }
+            break;
+
+        case WAV_S32:
+            memcpy(work, raw, samples * sizeof(int));
+            break;
+    }
+}
+
+void wav_encode(const WavInfo *info, const int *work, void *raw, size_t samples) {
+    unsigned char *out = raw;
+
+    switch (info->sample_type) {
+        case WAV_U8:
+            for (size_t i = 0; i < samples; i++) {
+                out[i] = (unsigned char)(work[i] + 128);
+            }
+            break;
+
+        case WAV_S16: {
+            size_t i = 0;
+#ifdef __SSE2__
+            for (; i + 8 <= samples; i += 8) {
+                // Keep the low 16 bits of each int (sign-extended again, so the pack cannot saturate)
+                __m128i lo = _mm_loadu_si128((const __m128i *)(work + i));
+                __m128i hi = _mm_loadu_si128((const __m128i *)(work + i + 4));
+                lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+                hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+                _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packs_epi32(lo, hi));
+            }
+#endif
+            for (; i < samples; i++) {
+                short sample = work[i];
+                memcpy(out + 2 * i, &sample, sizeof(short));
+            }
+            break;
+        }
+
+        case WAV_S24:
+            for (size_t i = 0; i < samples; i++) {
+                unsigned char *p = out + 3 * i;
+                p[0] = work[i] & 0xFF;
+                p[1] = (work[i] >> 8) & 0xFF;
+                p[2] = (work[i] >> 16) & 0xFF;
+            }
+            break;
+
+        case WAV_S32:
+            memcpy(raw, work, samples * sizeof(int));
+            break;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define WAV_HEADER_BYTES 44     // Size of the canonical header the tools write
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+#define WAV_SIZE_UNKNOWN 0xFFFFFFFFu    // Data size written by streaming encoders that cannot seek back
+
+// Sample encodings the tools can process
+#define WAV_U8 0        // 8-bit unsigned PCM, silence at 128
+#define WAV_S16 1       // 16-bit signed PCM
+#define WAV_S24 2       // 24-bit signed PCM, packed in 3 bytes
+#define WAV_S32 3       // 32-bit signed PCM
+#define WAV_F32 4       // 32-bit IEEE float
+
+// Error codes returned by the parsers
+#define WAV_ERR_NOT_RIFF -1
+#define WAV_ERR_NO_FMT -2
+#define WAV_ERR_UNSUPPORTED -3
+#define WAV_ERR_NO_DATA -4
+
+/*
+ * What the tools need to know about a WAV file: the sample layout from the fmt chunk and
+ * where the data chunk sits. Everything else (LIST, fact, cue, ...) is skipped.
+ */
+typedef struct wav_info {
+    int format;                 // WAV_FORMAT_PCM or WAV_FORMAT_FLOAT (extensible is resolved)
+    int sample_type;            // WAV_U8 .. WAV_F32
+    int channels;
+    unsigned int sample_rate;
+    int bits_per_sample;
+    int sample_bytes;           // Bytes per sample of one channel
+    int block_align;            // Bytes per frame (all channels)
+    size_t data_offset;         // File offset of the first sample
+    size_t data_size;           // Bytes of sample data, or WAV_SIZE_UNKNOWN
+} WavInfo;
+
+// Parse the header of a WAV file held in memory. Returns 0 or a WAV_ERR_ code.
+// data_size is clamped to the bytes actually present in the buffer.
+int wav_parse_buffer(const void *buf, size_t len, WavInfo *info);
+
+// Read chunks from f up to the first sample, skipping any chunk that is not fmt or data.
+// Works on pipes. Returns 0 or a WAV_ERR_ code.
+int wav_read_header(FILE *f, WavInfo *info);
+
+// Read the header of the file open on fd, leaving fd itself to be read with explicit offsets.
+// As with wav_parse_buffer, data_size is clamped to what a regular file actually holds.
+int wav_read_header_fd(int fd, WavInfo *info);
+
+const char *wav_strerror(int err);
+
+// Build a canonical 44-byte header describing data_size bytes of samples in info's format.
+void wav_make_header(unsigned char *header, const WavInfo *info, size_t data_size);
+
+// Convert between packed samples and 32-bit integer working samples (any PCM type).
+// U8 is re-centred on 0. F32 is processed as float and never goes through here.
+void wav_decode(const WavInfo *info, const void *raw, int *work, size_t samples);
+void wav_encode(const WavInfo *info, const int *work, void *raw, size_t samples);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "wav.h"
+
+#define BLOCK_FRAMES 16384
+
+/*
+ * Deterministic test signal: two tones a fifth apart, different in every channel,
+ * with a little noise on top. The same options and seed always give the same file.
+ */
+typedef struct generator {
+    unsigned long long noise;   // xorshift64 state
+    double phase;
+    double step;
+} Generator;
+
+static double next_noise(Generator *g) {
+    g->noise ^= g->noise << 13;
+    g->noise ^= g->noise >> 7;
+    g->noise ^= g->noise << 17;
+    return (double)(g->noise >> 11) / (1ULL << 53) * 2.0 - 1.0;
+}
+
+// Next sample of channel c in [-1, 1).
+static double next_sample(Generator *g, int c) {
+    double t = g->phase * (1.0 + 0.01 * c);
+    return 0.45 * sin(t) + 0.3 * sin(1.5 * t) + 0.05 * next_noise(g);
+}
+
+static long parse_positive(const char *arg, const char *what) {
+    char *err;
+    long value = strtol(arg, &err, 10);
+    if (*err != '\0' || value <= 0) {
+        fprintf(stderr, "%s Must Be a Positive Integer\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    int channels = 2;
+    long sample_rate = 44100;
+    int bits = 16;
+    int is_float = 0;
+    double seconds = 10;
+    long long frames = -1;
+    unsigned long long seed = 209;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:b:Fs:n:x:")) != -1) {
+        switch (opt) {
+            case 'c':
+                channels = parse_positive(optarg, "Channel Count");
+                break;
+            case 'r':
+                sample_rate = parse_positive(optarg, "Sample Rate");
+                break;
+            case 'b':
+                bits = parse_positive(optarg, "Bits Per Sample");
+                break;
+            case 'F':
+                is_float = 1;
+                bits = 32;
+                break;
+            case 's':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'n':
+                frames = strtoll(optarg, NULL, 10);
+                break;
+            case 'x':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c channels] [-r sample_rate] [-b bits | -F] [-s seconds | -n frames] "
+                                "[-x seed] dest_file\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Empty File Parameter\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bits != 8 && bits != 16 && bits != 24 && bits != 32) {
+        fprintf(stderr, "Bits Per Sample Must Be 8, 16, 24 or 32\n");
+        exit(EXIT_FAILURE);
+    }
+    if (channels > 65535 || sample_rate > 0xFFFFFFFFL) {
+        fprintf(stderr, "Channel Count or Sample Rate Too Large\n");
+        exit(EXIT_FAILURE);
+    }
+    if (frames < 0) {
+        frames = (long long)(seconds * sample_rate);
+    }
+
+    WavInfo info;
+    memset(&info, 0, sizeof(info));
+    info.format = is_float ? WAV_FORMAT_FLOAT : WAV_FORMAT_PCM;
+    info.sample_type = is_float ? WAV_F32 : bits == 8 ? WAV_U8 : bits == 16 ? WAV_S16
+                     : bits == 24 ? WAV_S24 : WAV_S32;
+    info.channels = channels;
+    info.sample_rate = sample_rate;
+    info.bits_per_sample = bits;
+    info.sample_bytes = bits / 8;
+    info.block_align = channels * info.sample_bytes;
+
+    FILE *dest = strcmp(argv[optind], "-") == 0 ? stdout : fopen(argv[optind], "wb");
+    if (dest == NULL) {
+        fprintf(stderr, "Invalid File: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t data_size = (size_t)frames * info.block_align;
+    unsigned char header[WAV_HEADER_BYTES];
+    wav_make_header(header, &info, data_size);
+    fwrite(header, WAV_HEADER_BYTES, 1, dest);
+
+    size_t block_samples = (size_t)BLOCK_FRAMES * channels;
+    int *work = malloc(block_samples * sizeof(int));
+    unsigned char *block = malloc(block_samples * sizeof(int));
+    if (work == NULL || block == NULL) {
+        fprintf(stderr, "Memory allocation failed for block\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Generator g = {seed * 0x9E3779B97F4A7C15ULL | 1, 0.0, 2.0 * M_PI * 220.0 / sample_rate};
+    const double full_scale = bits == 32 ? 2147483647.0 : (double)((1L << (bits - 1)) - 1);
+
+    for (long long done = 0; done < frames; ) {
+        int n = frames - done < BLOCK_FRAMES ? frames - done : BLOCK_FRAMES;
+        for (int i = 0; i < n; i++) {
+            for (int c = 0; c < channels; c++) {
+                double sample = next_sample(&g, c);
+                if (is_float) {
+                    ((float *)block)[i * channels + c] = sample;
+                } else {
+                    work[i * channels + c] = (int)(sample * full_scale);
+                }
+            }
+            g.phase += g.step;
+        }
+        if (!is_float) {
+            wav_encode(&info, work, block, (size_t)n * channels);
+        }
+        fwrite(block, info.block_align, n, dest);
+        done += n;
+    }
+    if (data_size & 1) {
+        fputc(0, dest);
+    }
+
+    free(work);
+    free(block);
+    if (fclose(dest) != 0) {
+        perror("fclose");
+        return 1;
+    }
+    return 0;
+}
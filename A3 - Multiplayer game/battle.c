@@ -137,55 +137,722 @@ Awaiting next opponent...
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>    /* Internet domain header */
+#include <netinet/tcp.h>
 #include <arpa/inet.h>     /* only needed on mac */
 
+#ifndef PORT
+#define PORT 57230
+#endif
+#ifndef ADMIN_PORT
+#define ADMIN_PORT (PORT + 1) // Metrics, in Prometheus text, for localhost only
+#endif
+
 #define WAITING 1
 #define BATTLING 0
+#define NAMING 2 // Connected, but has not finished typing their name yet
 
 #define MAX_BUF 100
-#define MAX_CLIENTS 100
+#define LISTEN_BACKLOG 4096 // Connections the kernel holds while a shard gets round to accepting them
+#define MAX_EVENTS 64 // Events handled per epoll_wait
+#define MAX_SHARDS 64
+#define READ_CHUNK 4096 // Bytes taken off a socket per recv
+#define OUT_MAX 65536 // How far behind on output a client can fall before they are cut off
+#define OUT_INLINE 1024 // Output a client can have queued before it needs a buffer of its own
+#define SLAB_OBJECTS 64 // Objects a pool carves out of each malloc
+#define METRICS_BUF 16384
+
+// Latency histograms (in us): exact below 32, then 16 buckets per power of two, so any value is within about 6%
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS 1024
+
+/*
+ * Add to a counter that only the current shard's thread writes. A relaxed load and store
+ * cost no more than a plain add (no locked instruction on the hot path), and the metrics
+ * thread still always reads whole values.
+ */
+#define COUNT(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+#define START_HP 30
+#define START_PM 3
+#define TURN_TIMEOUT_MS 5000 // How long the attacker has to pick a move
+
+// What a battle is waiting for from its attacker
+#define AWAIT_MOVE 0
+#define AWAIT_SPEECH 1
+
+// Where a client is in matchmaking
+#define NOT_QUEUED 0 // Not waiting (or on the way to another shard)
+#define READY 1 // Just started waiting, on its shard's ready list until match_players looks at it
+#define QUEUED 2 // On the board, nobody to fight so far
+#define RESERVED 3 // Taken off the board by another shard, whose client is on its way over
+
+// What one shard can ask of another
+#define MSG_BROADCAST 0 // Tell every named client that someone came or went
+#define MSG_ADOPT 1 // Take over a client, and start their battle against opponent if still around
+
+/*
+ * The binary protocol, for bots and apps that have no use for the prose. A client asks for it
+ * by making its first two bytes 0 and BINARY_VERSION (no name starts with a 0 byte); the name
+ * prompt, sent on connect, is the only text it ever gets. From there on everything, both ways,
+ * is a frame: a 2-byte big-endian length, then that many bytes, the first of which is the frame
+ * type and the rest its payload. Numbers are one signed byte each. A turn comes to about 50
+ * bytes this way, against about 400 of sentences.
+ */
+#define BINARY_VERSION 1
+#define FRAME_MAX (MAX_BUF + 2) // Longest client frame, length and type included
+
+// Client to server. Frames that don't fit the moment (a move while waiting, say) are ignored
+#define F_NAME 0x01 // Their name, answering the prompt
+#define F_MOVE 0x02 // 'a', 'p', 's' or 'r', when it is their turn
+#define F_SPEAK 0x03 // What to say, after moving 's'
+
+// Server to client
+#define F_HELLO 0x80 // BINARY_VERSION: frames from here on. A version the server lacks is hung up on
+#define F_WELCOME 0x81 // Their name: they are in and waiting for an opponent
+#define F_JOINED 0x82 // Name of someone who entered the arena
+#define F_LEFT 0x83 // Name of someone who left
+#define F_ENGAGE 0x84 // Name of their opponent: a battle starts
+#define F_TURN 0x85 // Your turn (1 or 0), your hp, your powermoves, the opponent's hp
+#define F_HIT 0x86 // By you (1, else you were hit), damage
+#define F_MISS 0x87 // By you (1, else the opponent missed you)
+#define F_RANDOM 0x88 // What a random move chose: powermove (1) or regular attack (0)
+#define F_SPEAKING 0x89 // You (1: send F_SPEAK) or the opponent (0) take a break to speak
+#define F_SPEECH 0x8A // By you (1) or the opponent (0), then what was said
+#define F_TIMEOUT 0x8B // Your time ran out; a random move is made for you
+#define F_RESULT 0x8C // RESULT_*, after which they wait for the next opponent
+
+#define RESULT_LOST 0
+#define RESULT_WON 1
+#define RESULT_DROPPED 2 // Won, because the opponent left
+
+// Which protocol a client speaks
+#define PROTO_NEW 0 // Nothing read yet
+#define PROTO_HELLO 1 // Got the 0 byte, the version is next
+#define PROTO_TEXT 2
+#define PROTO_BINARY 3
+
+struct battle;
+struct shard;
 
 typedef struct client {
         // Clients have names, state (In battle, waiting), in_addr
-        char *name;
+        char name[MAX_BUF];
         int state;
         struct sockaddr_in addr;
-        struct client *last_opponent;
+        unsigned long long id; // Unique for the life of the server, unlike fd or the address
+        unsigned long long last_opponent; // id of who they fought last, 0 if nobody
+        long long waiting_since; // us, when they last started waiting for an opponent
         int fd;
+        int queued; // NOT_QUEUED, READY, QUEUED or RESERVED; written under board_lock once on the board
+        struct shard *home; // Shard that owns the client
+        struct client *wait_prev; // Neighbours on the ready list or the board, whichever it is on
+        struct client *wait_next;
+        struct battle *battle; // Battle the client is in, NULL unless BATTLING
+        int proto; // PROTO_NEW until their first bytes say which
+        char line[FRAME_MAX]; // Line typed so far (name or speech), not null-terminated yet;
+                              // for a binary client, the frame received so far
+        int line_len;
+        char *out; // Output not sent yet: this pass's, and whatever the socket would not take.
+                   // Points at out_inline unless a slow reader has let it grow past that
+        char out_inline[OUT_INLINE];
+        int out_len;
+        int out_cap;
+        int watching_out; // Whether EPOLLOUT is on for the socket
+        int dirty; // 1 + index in shard->dirty while output is waiting for the end of the pass
     } Client;
 
     typedef struct clientNode {
         struct client client;
+        struct clientNode *prev;
         struct clientNode *next;
     } ClientNode;
 
-ClientNode *front = NULL; //beginning of dynamic array
+/*
+ * A FIFO of clients linked through their own wait_prev/wait_next, so joining it, leaving it
+ * from anywhere and taking the front are all O(1) with no allocation.
+ */
+typedef struct queue {
+    Client *head;
+    Client *tail;
+} Queue;
+
+/*
+ * One fight between two clients. Nothing blocks while a battle is on: it just remembers
+ * whose turn it is and what it is waiting for, and moves on when that client's line arrives
+ * (or when the turn deadline passes). Every battle is advanced by its shard's event loop.
+ */
+typedef struct battle {
+    Client *player[2]; // player[0] strikes first
+    int hp[2];
+    int pm[2];
+    int turn; // Index of the attacker
+    int phase; // AWAIT_MOVE or AWAIT_SPEECH
+    long long deadline; // When the attacker's time to move runs out (ms), 0 while not timed
+    struct battle *timer_prev; // Neighbours on the shard's timer list, while timed
+    struct battle *timer_next;
+} Battle;
+
+// Something for a shard to do, sent by another shard.
+typedef struct message {
+    int type; // MSG_BROADCAST or MSG_ADOPT
+    int event; // MSG_BROADCAST: F_JOINED or F_LEFT
+    char name[MAX_BUF]; // MSG_BROADCAST: who
+    ClientNode *node; // MSG_ADOPT: the client to take over
+    int opponent_fd; // MSG_ADOPT: the client they are to fight, who the fd is checked against
+    unsigned long long opponent;
+    struct message *next;
+} Message;
+
+/*
+ * Fixed-size objects, recycled through a free list. New ones are carved SLAB_OBJECTS at a time
+ * out of one malloc, and nothing ever goes back to malloc, so clients and battles coming and
+ * going cost a couple of pointer moves and can't fragment the heap. A pool belongs to one
+ * shard; an object freed on another shard (a client handed off, a message) joins that one's.
+ */
+typedef struct pool {
+    size_t size;
+    void *free; // Recycled objects, each starting with a pointer to the next
+    char *slab; // Where the next new object comes from
+    int slab_left;
+    unsigned long hits; // Gets served from the free list
+    unsigned long misses; // Gets that had to take a new object
+} Pool;
+
+// Latencies in us, bucketed log-linearly like an HDR histogram. One writer, COUNTed.
+typedef struct histogram {
+    unsigned long bucket[HIST_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+} Histogram;
+
+/*
+ * One reactor thread. A shard owns its clients and their battles outright: only its own
+ * thread reads their sockets or touches their state, so turns need no locks at all. Shards
+ * only meet on the matchmaking board, and through their inboxes when a client has to move
+ * to the shard of their opponent, or when everybody has to hear something.
+ */
+typedef struct shard {
+    int id;
+    int epoll_fd;
+    int listen_fd; // Its own SO_REUSEPORT listener, so the kernel spreads connections out
+    int wake_fd; // eventfd, bumped whenever something is put in the inbox
+    ClientNode *front; //beginning of dynamic array
+    ClientNode **by_fd; // The same clients, looked up by socket
+    int by_fd_size;
+    Queue ready; // Clients that started waiting since match_players last ran
+    // Battles waiting for a move, soonest deadline first. Every turn gets the same
+    // TURN_TIMEOUT_MS, so deadlines come in order and new ones just go on the back:
+    // a timer wheel with a single slot, O(1) to start, cancel or find the next one.
+    Battle *timers;
+    Battle *timers_tail;
+    long long now; // ms, as of the start of this pass of the loop
+    long long pass_start; // The same in us
+    int moves; // Moves played during this pass
+    unsigned int seed; // for rand_r, so moves don't contend on rand()'s lock
+    Client **dirty; // Clients with output to send at the end of this pass of the loop
+    int dirty_len;
+    int dirty_cap;
+    // COUNTed, so main and the metrics thread can add them up from other threads
+    unsigned long turns; // Turns shown, including ones shown again after a bad move
+    unsigned long messages; // send_str calls, what used to be a write each
+    unsigned long sends; // send calls actually made
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long connections;
+    unsigned long battles_started;
+    unsigned long handoffs; // Clients sent to another shard for their battle
+    long clients_in[3]; // Clients by state. Handoffs move them without telling, so
+                        // only the sum over all shards means anything
+    Histogram match_wait; // From starting to wait to the battle starting
+    Histogram turn_latency; // From the pass that took a move starting to its answer going out
+    Pool client_pool; // ClientNodes
+    Pool battle_pool;
+    Pool message_pool;
+    pthread_mutex_t inbox_lock;
+    Message *inbox;
+    Message *inbox_tail;
+    pthread_t thread;
+} Shard;
+
+Shard shards[MAX_SHARDS];
+int num_shards;
+__thread Shard *shard; // The shard the running thread is
+volatile sig_atomic_t stopping = 0;
+sigset_t wait_mask; // Signal mask of shard 0 while it waits: the only time ^C gets through
+
+// Every client still looking for an opponent, whoever waited longest first
+Queue board;
+pthread_mutex_t board_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long next_client_id = 1;
 
 //FUNCTION PROTOTYPES
+void *run_shard(void *arg);
+void stop(int sig);
+void *serve_metrics(void *arg);
+int open_listener(void);
 int accept_player(int listen_soc);
+void read_client(Client *client);
+void drop_client(Client *client);
+void start_waiting(Client *client);
+Client *find_opponent(Client *client);
+void match_players(void);
+void hand_off(Client *client, Client *opponent);
+void read_inbox(void);
 void engage_battle(Client *p1, Client *p2);
+void engaged(Client *client, Client *opponent);
+void send_speech(Client *client, int by_you, const char *speech);
+void start_turn(Battle *battle);
+void play_move(Battle *battle, char move);
+void end_battle(Battle *battle, int winner, int dropped);
+void start_timer(Battle *battle);
+void cancel_timer(Battle *battle);
+void expire_turns(void);
+int next_timeout(void);
+void track_client(ClientNode *node);
+ClientNode *unlink_client(int fd);
 void delete_client(int fd);
 
-int main() {
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int bucket_of(long long v) {
+    if (v < SUB_COUNT) {
+        return v < 0 ? 0 : v;
+    }
+    int shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1); // Leaves v >> shift in [16, 31]
+    return shift * (SUB_COUNT / 2) + (int) (v >> shift);
+}
+
+// The largest value that falls in bucket b.
+long long bucket_top(int b) {
+    if (b < SUB_COUNT) {
+        return b;
+    }
+    int shift = b / (SUB_COUNT / 2) - 1;
+    long long m = b % (SUB_COUNT / 2) + SUB_COUNT / 2;
+    return ((m + 1) << shift) - 1;
+}
+
+// Record n values of us microseconds in one of the running shard's histograms.
+void record(Histogram *h, long long us, int n) {
+    COUNT(h->bucket[bucket_of(us)], n);
+    COUNT(h->count, n);
+    COUNT(h->sum, n * us);
+}
+
+// Move a client to another state, keeping the shard's count of each right.
+void set_state(Client *client, int state) {
+    COUNT(shard->clients_in[client->state], -1);
+    COUNT(shard->clients_in[state], 1);
+    client->state = state;
+}
+
+// Add c at the back of q.
+void queue_push(Queue *q, Client *c) {
+    c->wait_prev = q->tail;
+    c->wait_next = NULL;
+    if (q->tail == NULL) {
+        q->head = c;
+    } else {
+        q->tail->wait_next = c;
+    }
+    q->tail = c;
+}
+
+// Take c out of q, wherever it is.
+void queue_remove(Queue *q, Client *c) {
+    if (c->wait_prev == NULL) {
+        q->head = c->wait_next;
+    } else {
+        c->wait_prev->wait_next = c->wait_next;
+    }
+    if (c->wait_next == NULL) {
+        q->tail = c->wait_prev;
+    } else {
+        c->wait_next->wait_prev = c->wait_prev;
+    }
+}
+
+void pool_init(Pool *pool, size_t size) {
+    memset(pool, 0, sizeof(Pool));
+    pool->size = (size + 15) & ~(size_t) 15; // Keep every object 16-byte aligned
+}
+
+void *pool_get(Pool *pool) {
+    void *obj = pool->free;
+    if (obj != NULL) {
+        pool->free = *(void **) obj;
+        COUNT(pool->hits, 1);
+        return obj;
+    }
+
+    COUNT(pool->misses, 1);
+    if (pool->slab_left == 0) {
+        pool->slab = malloc(pool->size * SLAB_OBJECTS);
+        if (pool->slab == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        pool->slab_left = SLAB_OBJECTS;
+    }
+    obj = pool->slab;
+    pool->slab += pool->size;
+    pool->slab_left--;
+    return obj;
+}
+
+void pool_put(Pool *pool, void *obj) {
+    *(void **) obj = pool->free;
+    pool->free = obj;
+}
+
+// Which events the shard wants for a client: always input, and output while some is stuck.
+void watch(Client *client) {
+    int want_out = client->out_len > 0;
+    if (want_out == client->watching_out) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = want_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = client;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+    client->watching_out = want_out;
+}
+
+/*
+ * Queue len bytes for a client. Nothing is sent yet: everything a client is told during one
+ * pass of the event loop (a whole turn, say) goes out together in one send at the end of it,
+ * instead of a write (and a TCP segment) per line. A client that falls more than OUT_MAX
+ * behind is cut off.
+ */
+void send_bytes(Client *client, const char *msg, int len) {
+    COUNT(shard->messages, 1);
+
+    if (client->out_len + len > OUT_MAX) {
+        // Not reading: shut the socket so the read side drops them
+        shutdown(client->fd, SHUT_RDWR);
+        client->out_len = 0;
+        return;
+    }
+    if (client->out_len + len > client->out_cap) {
+        // Only a client that isn't keeping up gets here
+        int cap = 2 * client->out_cap;
+        while (cap < client->out_len + len) {
+            cap *= 2;
+        }
+        char *out = client->out == client->out_inline ? malloc(cap) : realloc(client->out, cap);
+        if (out == NULL) {
+            perror("realloc");
+            shutdown(client->fd, SHUT_RDWR);
+            return;
+        }
+        if (client->out == client->out_inline) {
+            memcpy(out, client->out_inline, client->out_len);
+        }
+        client->out = out;
+        client->out_cap = cap;
+    }
+    memcpy(client->out + client->out_len, msg, len);
+    client->out_len += len;
+
+    if (!client->dirty) {
+        if (shard->dirty_len == shard->dirty_cap) {
+            shard->dirty_cap = shard->dirty_cap == 0 ? 64 : 2 * shard->dirty_cap;
+            shard->dirty = realloc(shard->dirty, shard->dirty_cap * sizeof(Client *));
+            if (shard->dirty == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        shard->dirty[shard->dirty_len++] = client;
+        client->dirty = shard->dirty_len;
+    }
+}
+
+// Write a whole string to a client.
+void send_str(Client *client, const char *msg) {
+    send_bytes(client, msg, strlen(msg));
+}
+
+// Send a binary client one frame of the given type, with len bytes of payload.
+void send_frame(Client *client, int type, const void *payload, int len) {
+    char frame[3 + MAX_BUF];
+    frame[0] = (len + 1) >> 8;
+    frame[1] = (len + 1) & 0xff;
+    frame[2] = type;
+    memcpy(frame + 3, payload, len);
+    send_bytes(client, frame, 3 + len);
+}
+
+// Send a binary client a frame whose payload is count small numbers, a byte each.
+void send_numbers(Client *client, int type, int count, ...) {
+    char payload[8];
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++) {
+        payload[i] = va_arg(args, int);
+    }
+    va_end(args);
+    send_frame(client, type, payload, count);
+}
+
+/*
+ * Send as much of the client's queued output as the socket takes, without blocking. What is
+ * left goes out when the socket is writable again.
+ */
+void flush_client(Client *client) {
+    int sent = 0;
+    while (sent < client->out_len) {
+        COUNT(shard->sends, 1);
+        ssize_t n = send(client->fd, client->out + sent, client->out_len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                sent = client->out_len; // Gone; the read side cleans up
+            }
+            break;
+        }
+        sent += n;
+        COUNT(shard->bytes_out, n);
+    }
+    memmove(client->out, client->out + sent, client->out_len - sent);
+    client->out_len -= sent;
+    if (client->out_len == 0 && client->out != client->out_inline) {
+        // Caught up: back to the inline buffer
+        free(client->out);
+        client->out = client->out_inline;
+        client->out_cap = OUT_INLINE;
+    }
+    watch(client);
+}
+
+// Don't flush client at the end of this pass (it is leaving the shard).
+void forget_dirty(Client *client) {
+    if (client->dirty) {
+        shard->dirty[client->dirty - 1] = NULL;
+        client->dirty = 0;
+    }
+}
+
+// End of a pass of the loop: send everyone what they were told during it.
+void flush_dirty(void) {
+    for (int i = 0; i < shard->dirty_len; i++) {
+        Client *client = shard->dirty[i];
+        if (client != NULL) {
+            client->dirty = 0;
+            flush_client(client);
+        }
+    }
+    shard->dirty_len = 0;
+}
+
+// Tell every named client of this shard but except that name joined or left (event F_JOINED or F_LEFT).
+void broadcast(int event, const char *name, Client *except) {
+    char text[MAX_BUF + 32];
+    if (event == F_JOINED) {
+        sprintf(text, "**%s enters the arena**\r\n", name);
+    } else {
+        sprintf(text, "**%s leaves**\r\n", name);
+    }
+
+    for (ClientNode *curr = shard->front; curr != NULL; curr = curr->next) {
+        Client *client = &curr->client;
+        if (client == except || client->state == NAMING) {
+            continue;
+        }
+        if (client->proto == PROTO_BINARY) {
+            send_frame(client, event, name, strlen(name));
+        } else {
+            send_str(client, text);
+        }
+    }
+}
+
+// Put a message in another shard's inbox and wake it up.
+void post(Shard *to, Message *msg) {
+    msg->next = NULL;
+    pthread_mutex_lock(&to->inbox_lock);
+    if (to->inbox == NULL) {
+        to->inbox = msg;
+    } else {
+        to->inbox_tail->next = msg;
+    }
+    to->inbox_tail = msg;
+    pthread_mutex_unlock(&to->inbox_lock);
+
+    unsigned long long one = 1;
+    if (write(to->wake_fd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+}
 
+// Tell every named client on every shard but except.
+void broadcast_all(int event, const char *name, Client *except) {
+    broadcast(event, name, except);
+    for (int i = 0; i < num_shards; i++) {
+        if (&shards[i] != shard) {
+            Message *m = pool_get(&shard->message_pool);
+            m->type = MSG_BROADCAST;
+            m->event = event;
+            strcpy(m->name, name);
+            post(&shards[i], m);
+        }
+    }
+}
+
+#ifndef MATCH_BENCH
+/*
+ * Usage: battle [threads]
+ * Runs one shard per thread, as many as there are CPUs unless told otherwise.
+ */
+int main(int argc, char **argv) {
+
+    // A client that vanishes mid-write should not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // ^C prints what the shards did before leaving. Only this thread takes the signal
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    num_shards = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_shards < 1) {
+        num_shards = 1;
+    }
+    if (num_shards > MAX_SHARDS) {
+        num_shards = MAX_SHARDS;
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        Shard *s = &shards[i];
+        s->id = i;
+        s->seed = i + 1;
+        pool_init(&s->client_pool, sizeof(ClientNode));
+        pool_init(&s->battle_pool, sizeof(Battle));
+        pool_init(&s->message_pool, sizeof(Message));
+        s->listen_fd = open_listener();
+        pthread_mutex_init(&s->inbox_lock, NULL);
+
+        // epoll only reports the sockets that are ready, instead of us scanning fd 0..max_fd every time
+        s->epoll_fd = epoll_create1(0);
+        s->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (s->epoll_fd == -1 || s->wake_fd == -1) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; // NULL means the listener, the shard itself its inbox, anything else a Client
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        ev.data.ptr = s;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    // Shard 0 runs on this thread. It takes ^C only inside epoll_pwait, so stopping can't
+    // be set just after it was checked and then go unnoticed until the next event
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    pthread_t metrics_thread;
+    if (pthread_create(&metrics_thread, NULL, serve_metrics, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    for (int i = 1; i < num_shards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    run_shard(&shards[0]);
+
+    unsigned long turns = 0, messages = 0, sends = 0;
+    unsigned long hits[3] = {0, 0, 0}, misses[3] = {0, 0, 0};
+    for (int i = 0; i < num_shards; i++) {
+        turns += __atomic_load_n(&shards[i].turns, __ATOMIC_RELAXED);
+        messages += __atomic_load_n(&shards[i].messages, __ATOMIC_RELAXED);
+        sends += __atomic_load_n(&shards[i].sends, __ATOMIC_RELAXED);
+        Pool *pools[3] = {&shards[i].client_pool, &shards[i].battle_pool, &shards[i].message_pool};
+        for (int j = 0; j < 3; j++) {
+            hits[j] += __atomic_load_n(&pools[j]->hits, __ATOMIC_RELAXED);
+            misses[j] += __atomic_load_n(&pools[j]->misses, __ATOMIC_RELAXED);
+        }
+    }
+    fprintf(stderr, "%lu turns: %.1f messages and %.1f sends per turn\n", turns,
+            turns ? (double) messages / turns : 0.0, turns ? (double) sends / turns : 0.0);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "pool hits/misses: clients %lu/%lu, battles %lu/%lu, messages %lu/%lu; peak RSS %ld kB\n",
+            hits[0], misses[0], hits[1], misses[1], hits[2], misses[2], usage.ru_maxrss);
+    return 0;
+}
+
+void stop(int sig) {
+    stopping = 1;
+}
+#endif
+
+// One listening socket on PORT. Every shard binds its own, and the kernel shares connections out.
+int open_listener(void) {
     int listenfd = socket(AF_INET, SOCK_STREAM, 0); //socket
      if (listenfd == -1) {
         perror("server: socket");
         exit(1);
     }
-    
+
     //Assignment provided code. Lets the client connect to server, the moment it leaves.
     int yes = 1;
     if((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
         perror("setsockopt");
     }
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
 
 
     struct sockaddr_in server;
     server.sin_family = AF_INET;
-    server.sin_port = htons(57230);
+    server.sin_port = htons(PORT);
     memset(&server.sin_zero, 0, 8);
     server.sin_addr.s_addr = INADDR_ANY;
 
@@ -196,495 +863,1052 @@ int main() {
       exit(1);
     }
 
-    if (listen(listenfd, MAX_CLIENTS) < 0) {
+    if (listen(listenfd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         exit(1);
     }
 
-    fd_set master_fds; //arbitrary set of file descriptors
-    FD_ZERO(&master_fds);
-    FD_SET(listenfd, &master_fds); //setting listenfd in master_fds for future use
-    int max_fd = listenfd; // setting the number of file descriptors we will be watching for (volatile)
+    // The listener never blocks, so one accept too many just comes back with EAGAIN
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    return listenfd;
+}
+
+// The event loop of one shard.
+void *run_shard(void *arg) {
+    shard = arg;
 
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        fd_set read_fds = master_fds; // setting read_fds to master_fds (readfds is cleared of all fd except those ready to be read)
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) == -1) { 
-            //select blocks until activity happens in one of the file descriptors or timeout occurs, in this case, no timeout.
-            perror("select");
+        // Sleep until a socket is ready or the closest turn deadline passes
+        int ready = epoll_pwait(shard->epoll_fd, events, MAX_EVENTS, next_timeout(),
+                                shard->id == 0 ? &wait_mask : NULL);
+        shard->pass_start = now_us();
+        shard->now = shard->pass_start / 1000;
+        if (ready == -1) {
+            if (errno == EINTR) {
+                if (stopping) {
+                    return NULL;
+                }
+                continue;
+            }
+            perror("epoll_wait");
             exit(1);
         }
 
-        for (int fd = 0; fd <= max_fd; fd++) { 
-            //Iterate through each file descriptors one by one to see what file descriptor the change occured.
-            // A change has to have occured since select returned.
-            if (FD_ISSET(fd, &read_fds)) { //Check if fd is in read_fds, which is set of file descriptors that is to be observed.
-                if (fd == listenfd) { // If file descriptor is equal to listenfd, that means a client is trying to connect.
-                    // New client connection
-                    int client_socket = accept_player(listenfd);
-                    
-                    FD_SET(client_socket, &master_fds); 
-                    //Add client socket fd to master_fds to be observed in the future
-                    if (client_socket > max_fd) {
-                        max_fd = client_socket; // Making sure that you read up till client socket since client socket needs to be observed too.
-                    }
-                } else {
-                    // fd is not equal to listenfd, fd equals one of the client socket fds, some information needs to be read
-                    
-                    char buf[MAX_BUF + 1];
-                    ssize_t bytes_read = read(fd, buf, MAX_BUF);
-                    if (bytes_read <= 0) {
-                        // Client disconnected or error occurred
-                        if (bytes_read == 0) {
-                            // Client disconnected
-                            ClientNode *curr = front;
-                            char buf[MAX_BUF + strlen("** leaves**\r\n") + 1];
-                            
-                            Client *disconnecting_client;
-                            if (front != NULL) {
-                                while (curr->next != NULL) {
-                                    if (curr->client.fd != fd) {
-                                        write(curr->client.fd, buf, strlen(buf));
-                                    }
-                                    else {
-                                        disconnecting_client = &(curr->client);
-                                        }
-                                    curr = curr->next; 
-                                }
-                                if (front->client.fd == fd) {disconnecting_client = &front->client;}
-                            }
-                            sprintf(buf, "**%s leaves**\r\n", disconnecting_client->name);
-                        } else {
-                            // Error occurred
-                            perror("read");
-                        }
-                        delete_client(fd);
-                        close(fd); // Close the socket
-
-                        FD_CLR(fd, &master_fds); // Remove the socket from the master set
-                    }
-                    // Process data read from the client
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                // New client connection(s)
+                while (accept_player(shard->listen_fd) != -1) {
                 }
-
-            }
-        }
-         // Check if two clients can battle.
-        Client *pair[2] = {NULL, NULL}; //pair that could potentially battle.
-        int first_found = 0;
-
-        ClientNode *curr = front;
-
-        //loop through dynamic array, checking if there is a waiting client.
-        while (curr != NULL) {
-            
-            if (curr->client.state == WAITING) {
-                //waiting client found.
-                // Must check if they have battled before.
-                pair[first_found] = &curr->client;
-                if (first_found) {
-                    //pair has two clients.
-                    if (pair[0]->last_opponent == pair[1] || pair[1]->last_opponent == pair[0]) {
-                        pair[1] = NULL;
-                    }
+            } else if (events[i].data.ptr == shard) {
+                // Other shards want something
+                read_inbox();
+            } else {
+                // A client's socket can take more output, or has some information to be read
+                if (events[i].events & EPOLLOUT) {
+                    flush_client(events[i].data.ptr);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    read_client(events[i].data.ptr);
                 }
-                first_found = 1;
             }
-            curr = curr->next;
         }
-        // curr->next is NULL (No pair found) and/or pair found
 
-        if (pair[1] != NULL) {
-            // pair found.
-            pair[0]->state = BATTLING;
-            pair[0]->last_opponent = pair[1];
+        expire_turns();
+        match_players();
+        flush_dirty();
 
-            pair[1]->state = BATTLING;
-            pair[1]->last_opponent = pair[0];
-
-
-            engage_battle(pair[0], pair[1]);
+        if (shard->moves > 0) {
+            // Every move this pass was answered just now
+            record(&shard->turn_latency, now_us() - shard->pass_start, shard->moves);
+            shard->moves = 0;
         }
     }
-    return 0;
+    return NULL;
 }
 
+/*
+ * Accept one pending connection and ask for a name. The name is read later, as it arrives.
+ * Returns the new socket, or -1 once there is nobody left to accept.
+ */
 int accept_player(int listen_soc) {
     struct sockaddr_in client_addr;
 
     unsigned int client_len = sizeof(struct sockaddr_in);
 
     int client_socket = accept(listen_soc, (struct sockaddr *)&client_addr, &client_len);
-    
+
     if (client_socket == -1) {
-        perror("accept");
-        exit(1);
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept");
+        }
+        return -1;
     }
 
-    
-    if(write(client_socket, "What is your name?\r\n", strlen("What is your name?\r\n")) < 0) {
-        perror("write");
-        exit(1);
-    }
-    
-    char character;
-
-    Client client;
-    client.name = malloc(MAX_BUF);
-    client.name[0] = '\0';
-    
-    int i = 0;
-    while (read(client_socket, &character, 1)) {
-        if (character == '\n') {
-            client.name[i-1] = '\0'; // Null-terminate the name
-            break;
-        }
-        // printf("client.name: %s, character: %c, Available Space: %ld\n",
-            // client.name, character, MAX_BUF - strlen(client.name) - 1);
-        client.name[i] = character;
-        i++;
-    }
-    
-    client.addr = client_addr;
-    client.state = WAITING;
-    client.last_opponent = NULL;
-    client.fd = client_socket;
-    
-    ClientNode *curr = front;
-    char buf[MAX_BUF + strlen("** enters the arena**\r\n") + 1];
-    sprintf(buf, "**%s enters the arena**\r\n", client.name);
-    
-
-    if (front != NULL) {
-        ssize_t bytes_written;
-        while (curr->next != NULL) {
-            if ((bytes_written = write(curr->client.fd, buf, strlen(buf)) < 0)) {
-                perror("write");
-                exit(1);
-            } else if (bytes_written == 0) {
-                close(curr->client.fd);
-                delete_client(curr->client.fd);
-            }
-            
-            curr = curr->next;
-        }
-        ClientNode *node = (ClientNode *) malloc(sizeof(ClientNode));
-        node->client = client;
-        node->next = NULL;
-        curr->next = node;
-    } else {
-        
-        ClientNode *node = (ClientNode *) malloc(sizeof(ClientNode));
-        node->client = client;
-        node->next = NULL;
-        front = node;
+    // Clients never block the shard either; what they can't take yet waits in their queue
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+
+    // Output is already gathered into one send per pass, so Nagle would only hold a turn
+    // back waiting for the ACK of the last one
+    int yes = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
+    ClientNode *node = pool_get(&shard->client_pool);
+    Client *client = &node->client;
+    memset(client, 0, sizeof(Client));
+    client->name[0] = '\0';
+    client->addr = client_addr;
+    client->state = NAMING;
+    COUNT(shard->clients_in[NAMING], 1);
+    COUNT(shard->connections, 1);
+    client->id = __atomic_fetch_add(&next_client_id, 1, __ATOMIC_RELAXED);
+    client->last_opponent = 0;
+    client->fd = client_socket;
+    client->queued = NOT_QUEUED;
+    client->battle = NULL;
+    client->out = client->out_inline;
+    client->out_cap = OUT_INLINE;
+    track_client(node);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &node->client;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
+        perror("epoll_ctl");
+        delete_client(client_socket);
+        close(client_socket);
+        return client_socket;
     }
 
+    send_str(&node->client, "What is your name?\r\n");
+    return client_socket;
+}
+
+// The client finished typing their name: let everyone know, and put them in the queue.
+void name_entered(Client *client) {
+    strcpy(client->name, client->line);
+    start_waiting(client);
+
+    broadcast_all(F_JOINED, client->name, client);
+
     // nc -C localhost 57230
     //Client added to dynamic array.
 
+    if (client->proto == PROTO_BINARY) {
+        send_frame(client, F_WELCOME, client->name, strlen(client->name));
+        return;
+    }
     char welcome_message[MAX_BUF + strlen("Welcome ! Awaiting opponent...\r\n") + 1];
 
-    sprintf(welcome_message, "Welcome %s! Awaiting opponent...\r\n", client.name);
+    sprintf(welcome_message, "Welcome %s! Awaiting opponent...\r\n", client->name);
+    send_str(client, welcome_message);
+}
 
-    if(write(client_socket, welcome_message, strlen(welcome_message)) < 0) {
-        perror("write");
-        exit(1);
+/*
+ * A whole line arrived from client (without its \r\n). What it means depends on where the
+ * client is: a name, a move or something to say. Lines from waiting clients and from the
+ * defender are ignored, like before.
+ */
+void line_entered(Client *client) {
+    Battle *battle = client->battle;
+
+    if (client->state == NAMING) {
+        name_entered(client);
+    } else if (battle != NULL && battle->player[battle->turn] == client) {
+        if (battle->phase == AWAIT_SPEECH) {
+            Client *defender = battle->player[1 - battle->turn];
+            send_speech(client, 1, client->line);
+            send_speech(defender, 0, client->line);
+            start_turn(battle); // It is still the attacker's turn.
+        } else {
+            // The move is the first thing typed on the line
+            int i = 0;
+            while (client->line[i] == ' ' || client->line[i] == '\t') {
+                i++;
+            }
+            if (client->proto != PROTO_BINARY) {
+                send_str(client, "\r\n");
+            }
+            play_move(battle, client->line[i]);
+        }
     }
-    return client_socket;
 }
 
-void engage_battle(Client *p1, Client *p2) {
-    
-    fd_set read_fds;
-    struct timeval timeout;
+// Pass on what the attacker said, to the attacker (by_you) or the defender.
+void send_speech(Client *client, int by_you, const char *speech) {
+    if (client->proto == PROTO_BINARY) {
+        char payload[MAX_BUF];
+        payload[0] = by_you;
+        int len = strlen(speech);
+        memcpy(payload + 1, speech, len);
+        send_frame(client, F_SPEECH, payload, 1 + len);
+    } else if (by_you) {
+        send_str(client, "You speak: "); //Msgs before sending msg
+        send_str(client, speech); //Sending msg to both players
+        send_str(client, "\n\n");
+    } else {
+        send_str(client, speech);
+        send_str(client, "\n\n");
+    }
+}
 
+/*
+ * Take in a text client's bytes from start up to the end of the line, handling the line if
+ * it is complete. Returns where the next line starts.
+ */
+char *take_line(Client *client, char *start, char *end) {
+    char *newline = memchr(start, '\n', end - start);
+    int len = (newline != NULL ? newline : end) - start;
+    if (len > MAX_BUF - 1 - client->line_len) {
+        len = MAX_BUF - 1 - client->line_len; // Anything past MAX_BUF is cut off
+    }
+    memcpy(client->line + client->line_len, start, len);
+    client->line_len += len;
+    if (newline == NULL) {
+        return end;
+    }
 
-    // Initialize hitpoints and power moves
-    int p1_hp = 30;
-    int p2_hp = 30;
-    int p1_pm = 3;
-    int p2_pm = 3;
+    // nc -C ends lines with \r\n
+    if (client->line_len > 0 && client->line[client->line_len - 1] == '\r') {
+        client->line_len--;
+    }
+    client->line[client->line_len] = '\0';
+    client->line_len = 0;
+    line_entered(client);
+    return newline + 1;
+}
 
-    char buf[MAX_BUF + 1]; // Buffer for messages
+/*
+ * Take in a binary client's bytes from start up to the end of the frame, handling the frame if
+ * it is complete: its payload goes through line_entered like a line would, provided it is the
+ * kind of frame the client's state calls for. Returns where the next bytes start, or NULL if
+ * the client sent something that can't be a frame.
+ */
+char *take_frame(Client *client, char *start, char *end) {
+    unsigned char *frame = (unsigned char *) client->line;
+    int want = client->line_len < 2 ? 2 : 2 + (frame[0] << 8 | frame[1]);
+    int len = want - client->line_len;
+    if (len > end - start) {
+        len = end - start;
+    }
+    memcpy(client->line + client->line_len, start, len);
+    client->line_len += len;
+    start += len;
 
-    // Inform players about the engagement
-    sprintf(buf, "You engage %s!\r\n", p2->name);
-    write(p1->fd, buf, strlen(buf));
-    sprintf(buf, "You engage %s!\r\n", p1->name);
-    write(p2->fd, buf, strlen(buf));
-
-    // Loop until one of the players runs out of hitpoints
-    int i = 0;
-    while (p1_hp > 0 && p2_hp > 0) {
-        // Set up read_fds with the two clients' sockets
-        FD_ZERO(&read_fds);
-        FD_SET(p1->fd, &read_fds);
-        FD_SET(p2->fd, &read_fds);
-
-        timeout.tv_sec = 1; // Adjust timeout as needed
-        timeout.tv_usec = 0;
-
-        int ready = select(FD_SETSIZE, &read_fds, NULL, NULL, &timeout);
-        if (ready == -1) {
-            perror("select");
-            // Handle error, if any
-        } else {
-            // Check if p1 disconnected
-            if (FD_ISSET(p1->fd, &read_fds)) {
-                char buf[MAX_BUF];
-                ssize_t bytes_read = read(p1->fd, buf, MAX_BUF);
-                if (bytes_read <= 0) {
-                    // Client disconnected
-                    sprintf(buf, "--%s dropped. You win!\r\n\nAwaiting next opponent...\r\n", p2->name);
-                    write(p2->fd, buf, strlen(buf));
-                    // Update p2 as the winner
-                    p1_hp = 0; // End the battle
-                    break;
-                }
+    if (client->line_len == 2) {
+        int frame_len = frame[0] << 8 | frame[1];
+        return frame_len < 1 || frame_len > FRAME_MAX - 2 ? NULL : start;
+    }
+    if (client->line_len < want) {
+        return start;
+    }
+
+    int type = frame[2];
+    int payload_len = client->line_len - 3;
+    memmove(client->line, client->line + 3, payload_len);
+    client->line[payload_len] = '\0';
+    client->line_len = 0;
+
+    Battle *battle = client->battle;
+    int expected = client->state == NAMING ? F_NAME
+                   : battle != NULL && battle->phase == AWAIT_SPEECH ? F_SPEAK : F_MOVE;
+    if (type == expected) {
+        line_entered(client);
+    }
+    return start;
+}
+
+/*
+ * Work out the protocol from the client's first bytes (see BINARY_VERSION), taking in the one
+ * at start. Returns where the next bytes start, or NULL for a binary version we don't speak.
+ */
+char *negotiate(Client *client, char *start) {
+    if (client->proto == PROTO_NEW) {
+        if (*start != '\0') {
+            client->proto = PROTO_TEXT;
+            return start; // That was the name already
+        }
+        client->proto = PROTO_HELLO;
+        return start + 1;
+    }
+
+    if (*start != BINARY_VERSION) {
+        return NULL;
+    }
+    client->proto = PROTO_BINARY;
+    char version = BINARY_VERSION;
+    send_frame(client, F_HELLO, &version, 1);
+    return start + 1;
+}
+
+/*
+ * The client's socket is readable. Take in whatever is there without blocking, in chunks,
+ * handling each line (or frame) as it is completed. A partial one waits in client->line for
+ * the rest.
+ */
+void read_client(Client *client) {
+    char buf[READ_CHUNK];
+
+    while (1) {
+        ssize_t bytes_read = recv(client->fd, buf, sizeof(buf), 0);
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // Nothing more for now
+        }
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            // Client disconnected or error occurred
+            if (bytes_read == -1 && errno != ECONNRESET) {
+                perror("read");
             }
-            // Check if p2 disconnected
-            if (FD_ISSET(p2->fd, &read_fds)) {
-                char buf[MAX_BUF];
-                ssize_t bytes_read = read(p2->fd, buf, MAX_BUF);
-                if (bytes_read <= 0) {
-                    // Client disconnected
-                    sprintf(buf, "--%s dropped. You win!\r\n\nAwaiting next opponent...\r\n", p1->name);
-                    write(p1->fd, buf, strlen(buf));
-                    // Update p1 as the winner
-                    p2_hp = 0; // End the battle
-                    break;
-                }
+            drop_client(client);
+            return;
+        }
+        COUNT(shard->bytes_in, bytes_read);
+
+        char *start = buf;
+        char *end = buf + bytes_read;
+        while (start < end) {
+            if (client->proto == PROTO_TEXT) {
+                start = take_line(client, start, end);
+            } else if (client->proto == PROTO_BINARY) {
+                start = take_frame(client, start, end);
+            } else {
+                start = negotiate(client, start);
+            }
+            if (start == NULL) {
+                drop_client(client);
+                return;
             }
         }
 
-        Client *attacker, *defender;
-        if (i % 2 == 0) {
-            attacker = p1;
-            defender = p2;
+        if (bytes_read < (ssize_t) sizeof(buf)) {
+            return; // Took everything there was, no need to ask again
+        }
+    }
+}
+
+// The client is gone: end their battle, tell everyone, and forget about them.
+void drop_client(Client *client) {
+    if (client->battle != NULL) {
+        Battle *battle = client->battle;
+        end_battle(battle, battle->player[0] == client ? 1 : 0, 1);
+    }
+
+    // Take them out of matchmaking. A RESERVED client stays put: the shard that took them
+    // will not find them when their opponent arrives, and that opponent just waits again.
+    // Another shard may be reserving them right now, so queued is only read under the lock.
+    pthread_mutex_lock(&board_lock);
+    if (client->queued == READY) {
+        queue_remove(&shard->ready, client);
+    } else if (client->queued == QUEUED) {
+        queue_remove(&board, client);
+    }
+    pthread_mutex_unlock(&board_lock);
+
+    if (client->state != NAMING) {
+        broadcast_all(F_LEFT, client->name, client);
+    }
+
+    forget_dirty(client);
+    COUNT(shard->clients_in[client->state], -1);
+    int fd = client->fd;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    delete_client(fd);
+    close(fd); // Close the socket
+}
+
+// Whether a and b may fight: anyone but the one they just fought.
+int can_fight(Client *a, Client *b) {
+    return a->last_opponent != b->id && b->last_opponent != a->id;
+}
+
+// The client has nobody to fight (yet): have match_players find them someone.
+void start_waiting(Client *client) {
+    set_state(client, WAITING);
+    client->waiting_since = shard->pass_start;
+    client->queued = READY;
+    queue_push(&shard->ready, client);
+}
+
+/*
+ * The longest waiting client on the board that client may fight, or NULL. Only clients that
+ * last fought this one (or the one this one last fought) are skipped, so that is a step or
+ * two past the front at most, however many are waiting. Called with board_lock held.
+ */
+Client *find_opponent(Client *client) {
+    Client *opponent = board.head;
+    while (opponent != NULL && !can_fight(opponent, client)) {
+        opponent = opponent->wait_next;
+    }
+    return opponent;
+}
+
+/*
+ * Find opponents for the clients that started waiting on this shard. Each one takes the
+ * longest waiting client on the board that is not the one they just fought, from any shard,
+ * or joins the back of the board if there is none. An opponent on this shard is fought right
+ * here; one on another shard is reserved, and the client moves over to fight them there.
+ */
+void match_players(void) {
+    if (shard->ready.head == NULL) {
+        return; // Nobody new, so no need for the lock
+    }
+
+    pthread_mutex_lock(&board_lock);
+    Client *client;
+    while ((client = shard->ready.head) != NULL) {
+        queue_remove(&shard->ready, client);
+
+        Client *opponent = find_opponent(client);
+        if (opponent == NULL) {
+            // Nobody yet: wait on the board
+            client->queued = QUEUED;
+            queue_push(&board, client);
+            continue;
+        }
+
+        queue_remove(&board, opponent);
+        client->queued = NOT_QUEUED;
+        if (opponent->home == shard) {
+            opponent->queued = NOT_QUEUED;
+            engage_battle(opponent, client); // whoever waited longer strikes first
+        } else {
+            opponent->queued = RESERVED;
+            hand_off(client, opponent);
+        }
+    }
+    pthread_mutex_unlock(&board_lock);
+}
+
+// Give client to the shard of opponent, to fight them there.
+void hand_off(Client *client, Client *opponent) {
+    // Their output so far goes out from here; whatever the socket won't take travels with them
+    forget_dirty(client);
+    flush_client(client);
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    COUNT(shard->handoffs, 1);
+
+    Message *m = pool_get(&shard->message_pool);
+    m->type = MSG_ADOPT;
+    m->node = unlink_client(client->fd);
+    m->opponent_fd = opponent->fd;
+    m->opponent = opponent->id;
+    post(opponent->home, m);
+}
+
+// Take over a client from another shard, and start their battle if their opponent is still here.
+void adopt(ClientNode *node, int opponent_fd, unsigned long long opponent) {
+    track_client(node);
+
+    struct epoll_event ev;
+    node->client.watching_out = node->client.out_len > 0; // Their queue came along
+    ev.events = node->client.watching_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = &node->client;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, node->client.fd, &ev) == -1) {
+        perror("epoll_ctl");
+        drop_client(&node->client);
+        return;
+    }
+
+    // The fd may have been reused by now, so the id has to match too
+    Client *found = NULL;
+    pthread_mutex_lock(&board_lock);
+    if (opponent_fd < shard->by_fd_size && shard->by_fd[opponent_fd] != NULL) {
+        Client *c = &shard->by_fd[opponent_fd]->client;
+        if (c->id == opponent && c->queued == RESERVED) {
+            found = c;
+            found->queued = NOT_QUEUED;
+        }
+    }
+    pthread_mutex_unlock(&board_lock);
+
+    if (found != NULL) {
+        engage_battle(found, &node->client);
+    } else {
+        start_waiting(&node->client); // They dropped in the meantime
+    }
+}
+
+// Do whatever other shards asked, in the order they asked.
+void read_inbox(void) {
+    unsigned long long count;
+    if (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+
+    pthread_mutex_lock(&shard->inbox_lock);
+    Message *msg = shard->inbox;
+    shard->inbox = shard->inbox_tail = NULL;
+    pthread_mutex_unlock(&shard->inbox_lock);
+
+    while (msg != NULL) {
+        Message *next = msg->next;
+        if (msg->type == MSG_BROADCAST) {
+            broadcast(msg->event, msg->name, NULL);
         } else {
-            attacker = p2;
-            defender = p1;
+            adopt(msg->node, msg->opponent_fd, msg->opponent);
         }
+        pool_put(&shard->message_pool, msg);
+        msg = next;
+    }
+}
+
+void engage_battle(Client *p1, Client *p2) {
+    Battle *battle = pool_get(&shard->battle_pool);
+
+    // Initialize hitpoints and power moves
+    battle->player[0] = p1;
+    battle->player[1] = p2;
+    battle->hp[0] = battle->hp[1] = START_HP;
+    battle->pm[0] = battle->pm[1] = START_PM;
+    battle->turn = 0;
+    battle->deadline = 0;
+
+    set_state(p1, BATTLING);
+    p1->last_opponent = p2->id;
+    p1->battle = battle;
+    set_state(p2, BATTLING);
+    p2->last_opponent = p1->id;
+    p2->battle = battle;
+
+    COUNT(shard->battles_started, 1);
+    record(&shard->match_wait, shard->pass_start - p1->waiting_since, 1);
+    record(&shard->match_wait, shard->pass_start - p2->waiting_since, 1);
+
+    // Inform players about the engagement
+    engaged(p1, p2);
+    engaged(p2, p1);
+
+    start_turn(battle);
+}
 
+// Tell client who they are up against.
+void engaged(Client *client, Client *opponent) {
+    if (client->proto == PROTO_BINARY) {
+        send_frame(client, F_ENGAGE, opponent->name, strlen(opponent->name));
+        return;
+    }
+    char buf[MAX_BUF + 32];
+    sprintf(buf, "You engage %s!\r\n", opponent->name);
+    send_str(client, buf);
+}
+
+// Show both players where the fight stands, give the attacker their options and start the clock.
+void start_turn(Battle *battle) {
+    int a = battle->turn;
+    int d = 1 - a;
+    Client *attacker = battle->player[a];
+    Client *defender = battle->player[d];
+    char buf[MAX_BUF + 32];
+
+    if (attacker->proto == PROTO_BINARY) {
+        send_numbers(attacker, F_TURN, 4, 1, battle->hp[a], battle->pm[a], battle->hp[d]);
+    } else {
         // Inform the attacker about their status
-        sprintf(buf, "Your hitpoints: %d\r\n", i % 2 == 0 ? p1_hp : p2_hp);
-        write(attacker->fd, buf, strlen(buf));
-        if (!(( i % 2 == 0 && p1_pm == 0) || ( i % 2 == 1 && p2_pm == 0))) { 
-            sprintf(buf, "Your powermoves: %d\r\n", i % 2 == 0 ? p1_pm : p2_pm);
-            write(attacker->fd, buf, strlen(buf));
+        sprintf(buf, "Your hitpoints: %d\r\n", battle->hp[a]);
+        send_str(attacker, buf);
+        if (battle->pm[a] > 0) {
+            sprintf(buf, "Your powermoves: %d\r\n", battle->pm[a]);
+            send_str(attacker, buf);
         }
         // Inform the attacker about the defender's status
-        sprintf(buf, "\n%s's hitpoints: %d\r\n", defender->name, (i + 1) % 2 == 0 ? p1_hp : p2_hp);
-        write(attacker->fd, buf, strlen(buf));
+        sprintf(buf, "\n%s's hitpoints: %d\r\n", defender->name, battle->hp[d]);
+        send_str(attacker, buf);
 
+        // Provide options for the attacker
+        send_str(attacker, "\n(a)ttack\r\n");
+        if (battle->pm[a] > 0) {
+            send_str(attacker, "(p)owermove\r\n");
+        }
+        send_str(attacker, "(s)peak something\r\n");
+        send_str(attacker, "(r)andom choice between regular attack or powermove\r\n");
+    }
+
+    if (defender->proto == PROTO_BINARY) {
+        send_numbers(defender, F_TURN, 4, 0, battle->hp[d], battle->pm[d], battle->hp[a]);
+    } else {
         // Inform the defender about their status and the attacker's hp.
-        sprintf(buf, "Your hitpoints: %d\r\n", (i + 1) % 2 == 0 ? p1_hp : p2_hp);
-        write(defender->fd, buf, strlen(buf));
-        sprintf(buf, "Your powermoves: %d\r\n", (i + 1) % 2 == 0 ? p1_pm : p2_pm);
-        write(defender->fd, buf, strlen(buf));
-        sprintf(buf, "\n%s's hitpoints: %d\r\n", attacker->name, (i) % 2 == 0 ? p1_hp : p2_hp);
-        write(defender->fd, buf, strlen(buf));
+        sprintf(buf, "Your hitpoints: %d\r\n", battle->hp[d]);
+        send_str(defender, buf);
+        sprintf(buf, "Your powermoves: %d\r\n", battle->pm[d]);
+        send_str(defender, buf);
+        sprintf(buf, "\n%s's hitpoints: %d\r\n", attacker->name, battle->hp[a]);
+        send_str(defender, buf);
 
         // Inform the defender to wait for the attacker to strike
         sprintf(buf, "Waiting for %s to strike...\r\n\r\n", attacker->name);
-        write(defender->fd, buf, strlen(buf));
+        send_str(defender, buf);
+    }
 
-        // Provide options for the attacker
-        write(attacker->fd, "\n(a)ttack\r\n", strlen("\n(a)ttack\r\n"));
-        if (((i % 2 == 0) && p1_pm > 0) || ((i % 2 == 1) && p2_pm > 0)) {
-            write(attacker->fd, "(p)owermove\r\n", strlen("(p)owermove\r\n"));
-        }
-        
-        write(attacker->fd, "(s)peak something\r\n", strlen("(s)peak something\r\n"));
-        write(attacker->fd, "(r)andom choice between regular attack or powermove\r\n", 
-        strlen("(r)andom choice between regular attack or powermove\r\n"));
-        // See block selection below
-
-        fd_set set;
-        struct timeval timeout;
-
-        // Initialize the file descriptor set.
-        FD_ZERO(&set);
-        FD_SET(attacker->fd, &set);
-
-        // Initialize the timeout data structure.
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
-
-        // select returns 0 if timeout, 1 if input available, -1 if error.
-        int rv = select(FD_SETSIZE, &set, NULL, NULL, &timeout);
-
-        if (rv == -1) {
-            perror("select"); // error occurred in select()
-        } else if (rv == 0) {
-            write(attacker->fd, "\nTimeout occurred! No data after 5 seconds.\r\n\n",
-                strlen("\nTimeout occurred! No data after 5 seconds.\r\n\n"));
-            buf[0] = 'r';
-            buf[1] = '\0';
-        } else {
-            // User input available, read the data.
-            if (read(attacker->fd, buf, 1) < 0) {
-                perror("read");
-            }
-            buf[1] = '\0';
-            write(attacker->fd, "\r\n", 2);
-        }
-
-        // Handle the attacker's choice
-        if (strcmp(buf, "a") == 0) {
-            // Handle regular attack
-            int dmg = 3; // Example damage
-            
-            i % 2 == 0 ? (p2_hp -= dmg) : (p1_hp -= dmg);
-            sprintf(buf, "You hit %s for %d damage!\r\n", defender->name, dmg);
-            write(attacker->fd, buf, strlen(buf));
-
-            sprintf(buf, "%s hits you for %d damage!\r\n", attacker->name, dmg);
-            write(defender->fd, buf, strlen(buf));
-        } else if (strcmp(buf, "p") == 0) {
-            // Handle powermove
-            int power_attack = rand() % 19 + 12; // Example power move damage
-            // HANDLE IF POWERMOVE LANDS OR NOT
-
-            //chance of landing is 33.33%
-            int chance = rand() % 3;
-            if (chance != 1) {
-                sprintf(buf, "%s missed you!\r\n", attacker->name);
-                write(defender->fd, buf, strlen(buf));
+    COUNT(shard->turns, 1);
+    battle->phase = AWAIT_MOVE;
+    cancel_timer(battle);
+    start_timer(battle);
+}
+
+// Deal damage from the attacker to the defender and tell them both.
+void hit(Battle *battle, int damage) {
+    Client *attacker = battle->player[battle->turn];
+    Client *defender = battle->player[1 - battle->turn];
+    char buf[MAX_BUF + 32];
 
-                write(attacker->fd, "You missed!\r\n", strlen("You missed!\r\n"));
+    battle->hp[1 - battle->turn] -= damage;
+    if (attacker->proto == PROTO_BINARY) {
+        send_numbers(attacker, F_HIT, 2, 1, damage);
+    } else {
+        sprintf(buf, "You hit %s for %d damage!\r\n", defender->name, damage);
+        send_str(attacker, buf);
+    }
+    if (defender->proto == PROTO_BINARY) {
+        send_numbers(defender, F_HIT, 2, 0, damage);
+    } else {
+        sprintf(buf, "%s hits you for %d damage!\r\n", attacker->name, damage);
+        send_str(defender, buf);
+    }
+}
+
+// Handle the attacker's choice, then move on to the next turn (or the end of the battle).
+void play_move(Battle *battle, char move) {
+    int a = battle->turn;
+    Client *attacker = battle->player[a];
+    Client *defender = battle->player[1 - a];
+    char buf[MAX_BUF + 32];
+
+    shard->moves++;
+    if (move == 'a') {
+        // Handle regular attack
+        hit(battle, 3);
+    } else if (move == 'p' && battle->pm[a] > 0) {
+        // Handle powermove
+        int power_attack = rand_r(&shard->seed) % 19 + 12; // Example power move damage
+
+        //chance of landing is 33.33%
+        int chance = rand_r(&shard->seed) % 3;
+        if (chance != 1) {
+            if (defender->proto == PROTO_BINARY) {
+                send_numbers(defender, F_MISS, 1, 0);
+            } else {
+                sprintf(buf, "%s missed you!\r\n", attacker->name);
+                send_str(defender, buf);
             }
-            else {
-                i % 2 == 0 ? (p1_pm--) : (p2_pm--);
-                i % 2 == 0 ? (p2_hp -= power_attack) : (p1_hp -= power_attack);
-                
-                sprintf(buf, "You hit %s for %d damage!\r\n", defender->name, power_attack);
-                write(attacker->fd, buf, strlen(buf));
-
-                sprintf(buf, "%s hits you for %d damage!\r\n", attacker->name, power_attack);
-                write(defender->fd, buf, strlen(buf));}
-        } else if (strcmp(buf, "s") == 0) {
-            sprintf(buf, "%s takes a break to tell you:\r\n", attacker->name);
-            write(defender->fd, buf, strlen(buf));
-            
-            memset(buf, 0, sizeof(buf));
-            write(attacker->fd, "Speak:\r\n", strlen("Speak:\r\n"));
-            
-            char *msg = malloc(MAX_BUF + 1);
-            char character;
-
-            int j = 0;
-
-            while (read(attacker->fd, &character, 1) && j <= MAX_BUF) {
-                if (character != '\n') {
-                    msg[j] = character;
-                    j++;
-                }
-                else {
-                    msg[j] = '\0';
-                    break;
-                }
+            if (attacker->proto == PROTO_BINARY) {
+                send_numbers(attacker, F_MISS, 1, 1);
+            } else {
+                send_str(attacker, "You missed!\r\n");
             }
-
-            write(attacker->fd, "You speak: ", strlen("You speak:\r\n")); //Msgs before sending msg
-
-            write(attacker->fd, msg, strlen(msg)); //Sending msg to both players
-            write(defender->fd, msg, strlen(msg));
-
-            write(attacker->fd, "\n\n", strlen("\n\n"));
-            write(defender->fd, "\n\n", strlen("\n\n"));
-
-            free(msg);
-            i++; // It is still the attacker's turn.
-        } else if (strcmp(buf, "r") == 0) {
-            // Handle random number generator move
-            int random_choice = rand() % 2;
-            int attacker_pm;
-            attacker->state == p1->state ? (attacker_pm = p1_pm) : (attacker_pm = p2_pm);
-            if (random_choice == 0 || attacker_pm == 0) {
-                 // Handle regular attack
-                int dmg = 3; // Example damage
-                write(attacker->fd, "Random Choice chose regular attack\r\n",
-                strlen("Random Choice chose regular attack\r\n"));
-                
-                i % 2 == 0 ? (p2_hp -= dmg) : (p1_hp -= dmg);
-                sprintf(buf, "You hit %s for %d damage!\r\n", defender->name, dmg);
-                write(attacker->fd, buf, strlen(buf));
-
-                sprintf(buf, "%s hits you for %d damage!\r\n", attacker->name, dmg);
-                write(defender->fd, buf, strlen(buf));
-
-            } else if (random_choice == 1) {
-                // Handle powermove
-                int power_attack = rand() % 19 + 12; // Example power move damage
-                // HANDLE IF POWERMOVE LANDS OR NOT
-                write(attacker->fd, "Random Choice chose powermove\r\n",
-                strlen("Random Choice chose powermove\r\n"));
-                
-                i % 2 == 0 ? (p1_pm--) : (p2_pm--);
-                i % 2 == 0 ? (p2_hp -= power_attack) : (p1_hp -= power_attack);
-                
-                sprintf(buf, "You hit %s for %d damage!\r\n", defender->name, power_attack);
-                write(attacker->fd, buf, strlen(buf));
-
-                sprintf(buf, "%s hits you for %d damage!\r\n", attacker->name, power_attack);
-                write(defender->fd, buf, strlen(buf));
+        } else {
+            battle->pm[a]--;
+            hit(battle, power_attack);
+        }
+    } else if (move == 's') {
+        if (defender->proto == PROTO_BINARY) {
+            send_numbers(defender, F_SPEAKING, 1, 0);
+        } else {
+            sprintf(buf, "%s takes a break to tell you:\r\n", attacker->name);
+            send_str(defender, buf);
+        }
+        if (attacker->proto == PROTO_BINARY) {
+            send_numbers(attacker, F_SPEAKING, 1, 1);
+        } else {
+            send_str(attacker, "Speak:\r\n");
+        }
+        battle->phase = AWAIT_SPEECH; // The next line from the attacker is what they say
+        cancel_timer(battle); // ...and they can take as long as they like
+        return;
+    } else if (move == 'r') {
+        // Handle random number generator move
+        int random_choice = rand_r(&shard->seed) % 2;
+        if (random_choice == 0 || battle->pm[a] == 0) {
+            if (attacker->proto == PROTO_BINARY) {
+                send_numbers(attacker, F_RANDOM, 1, 0);
+            } else {
+                send_str(attacker, "Random Choice chose regular attack\r\n");
             }
+            hit(battle, 3);
         } else {
-            // Not among the input that is available.
-            i++; //Same turn. Ask again
+            if (attacker->proto == PROTO_BINARY) {
+                send_numbers(attacker, F_RANDOM, 1, 1);
+            } else {
+                send_str(attacker, "Random Choice chose powermove\r\n");
+            }
+            battle->pm[a]--;
+            hit(battle, rand_r(&shard->seed) % 19 + 12);
         }
+    } else {
+        // Not among the input that is available. Same turn, ask again
+        start_turn(battle);
+        return;
+    }
+
+    if (battle->hp[1 - a] <= 0) {
+        end_battle(battle, a, 0);
+        return;
+    }
+    battle->turn = 1 - a;
+    start_turn(battle);
+}
+
+// Tell client how their battle went: result for a binary client, text for anyone else.
+void send_result(Client *client, int result, const char *text) {
+    if (client->proto == PROTO_BINARY) {
+        send_numbers(client, F_RESULT, 1, result);
+    } else {
+        send_str(client, text);
+    }
+}
 
-        // Increment turn counter
-        i++;
+/*
+ * The battle is over: tell both players (dropped says the loser left instead of running out of
+ * hitpoints), put whoever is still here back in the queue, and free the battle.
+ */
+void end_battle(Battle *battle, int winner, int dropped) {
+    Client *won = battle->player[winner];
+    Client *lost = battle->player[1 - winner];
+    char buf[2 * MAX_BUF + 64];
+
+    if (dropped) {
+        sprintf(buf, "--%s dropped. You win!\r\n\nAwaiting next opponent...\r\n", lost->name);
+        send_result(won, RESULT_DROPPED, buf);
+    } else {
+        sprintf(buf, "You are no match for %s. You scurry away...\r\n\r\nAwaiting next opponent...\r\n", won->name);
+        // Send the loss message to the player whose HP reached 0
+        send_result(lost, RESULT_LOST, buf);
+        sprintf(buf, "%s gives up. You win!\r\n\r\nAwaiting next opponent...\r\n", lost->name);
+        send_result(won, RESULT_WON, buf);
     }
 
-    if (p1_hp <= 0 || p2_hp <= 0) {
-        char loss_message[MAX_BUF]; // Buffer for loss message
-        if (p1_hp <= 0) {
-            sprintf(loss_message, "You are no match for %s. You scurry away...\r\n\r\nAwaiting next opponent...\r\n", p2->name);
-            // Send the loss message to the player whose HP reached 0
-            write(p1->fd, loss_message, strlen(loss_message));
-            sprintf(loss_message, "%s gives up. You win!\r\n\r\nAwaiting next opponent...\r\n", p1->name);
-            write(p2->fd, loss_message, strlen(loss_message)); //Misleading variable name. loss message is actually victory message.
+    for (int i = 0; i < 2; i++) {
+        battle->player[i]->battle = NULL;
+        start_waiting(battle->player[i]);
+    }
+
+    cancel_timer(battle);
+    pool_put(&shard->battle_pool, battle);
+}
+
+// Start the attacker's clock. Nobody's deadline is later, so it goes on the back.
+void start_timer(Battle *battle) {
+    battle->deadline = shard->now + TURN_TIMEOUT_MS;
+    battle->timer_prev = shard->timers_tail;
+    battle->timer_next = NULL;
+    if (shard->timers_tail == NULL) {
+        shard->timers = battle;
+    } else {
+        shard->timers_tail->timer_next = battle;
+    }
+    shard->timers_tail = battle;
+}
+
+// Stop the attacker's clock, if it is running.
+void cancel_timer(Battle *battle) {
+    if (battle->deadline == 0) {
+        return;
+    }
+    if (battle->timer_prev == NULL) {
+        shard->timers = battle->timer_next;
+    } else {
+        battle->timer_prev->timer_next = battle->timer_next;
+    }
+    if (battle->timer_next == NULL) {
+        shard->timers_tail = battle->timer_prev;
+    } else {
+        battle->timer_next->timer_prev = battle->timer_prev;
+    }
+    battle->deadline = 0;
+}
+
+// Attackers whose time ran out get a random move made for them.
+void expire_turns(void) {
+    Battle *battle;
+    while ((battle = shard->timers) != NULL && battle->deadline <= shard->now) {
+        cancel_timer(battle); // play_move starts a new clock, or frees the battle
+        Client *attacker = battle->player[battle->turn];
+        if (attacker->proto == PROTO_BINARY) {
+            send_frame(attacker, F_TIMEOUT, "", 0);
         } else {
-            sprintf(loss_message, "You are no match for %s. You scurry away...\r\n\r\nAwaiting next opponent...\r\n", p1->name);
-            // Send the loss message to the player whose HP reached 0
-            write(p2->fd, loss_message, strlen(loss_message));
-            sprintf(loss_message, "%s gives up. You win!\r\n\r\nAwaiting next opponent...\r\n", p2->name);
-            write(p1->fd, loss_message, strlen(loss_message)); //Misleading variable name. loss message is actually victory message.
+            send_str(attacker, "\nTimeout occurred! No data after 5 seconds.\r\n\n");
         }
+        play_move(battle, 'r');
     }
-    p1->state=WAITING;
-    p2->state=WAITING;
-    
-    return;
+}
 
+// Milliseconds until the closest turn deadline, or -1 (wait forever) when no battle has one.
+int next_timeout(void) {
+    if (shard->timers == NULL) {
+        return -1;
+    }
+    long long closest = shard->timers->deadline;
+    long long now = now_ms();
+    return closest <= now ? 0 : (int)(closest - now);
+}
+
+// Add a client to this shard: to the front of its list, and to its table by fd.
+void track_client(ClientNode *node) {
+    int fd = node->client.fd;
+    if (fd >= shard->by_fd_size) {
+        int size = shard->by_fd_size == 0 ? 64 : shard->by_fd_size;
+        while (size <= fd) {
+            size *= 2;
+        }
+        ClientNode **by_fd = realloc(shard->by_fd, size * sizeof(ClientNode *));
+        if (by_fd == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(by_fd + shard->by_fd_size, 0, (size - shard->by_fd_size) * sizeof(ClientNode *));
+        shard->by_fd = by_fd;
+        shard->by_fd_size = size;
+    }
+    shard->by_fd[fd] = node;
+
+    node->client.home = shard;
+    node->prev = NULL;
+    node->next = shard->front;
+    if (shard->front != NULL) {
+        shard->front->prev = node;
+    }
+    shard->front = node;
+}
+
+// Take the client with this fd out of this shard's list and table, without freeing it.
+ClientNode *unlink_client(int fd) {
+    if (fd >= shard->by_fd_size || shard->by_fd[fd] == NULL) {
+        return NULL;
+    }
+    ClientNode *curr = shard->by_fd[fd];
+    shard->by_fd[fd] = NULL;
+
+    if (curr->prev == NULL) {
+        shard->front = curr->next;
+    } else {
+        curr->prev->next = curr->next;
+    }
+    if (curr->next != NULL) {
+        curr->next->prev = curr->prev;
+    }
+    return curr;
 }
 
 void delete_client(int fd) {
-    if (front != NULL) {
-        if (front->client.fd == fd) {
-            front = front->next;
-            return;
+    ClientNode *curr = unlink_client(fd);
+    if (curr == NULL) {
+        return;
+    }
+    if (curr->client.out != curr->client.out_inline) {
+        free(curr->client.out);
+    }
+    pool_put(&shard->client_pool, curr);
+}
+
+// Add formatted text to the end of buf, which has room for METRICS_BUF bytes in all.
+void append(char *buf, int *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, METRICS_BUF - *len, format, args);
+    va_end(args);
+    if (n > 0) {
+        *len = *len + n < METRICS_BUF ? *len + n : METRICS_BUF - 1;
+    }
+}
+
+// One counter summed over the shards, in Prometheus text.
+void append_counter(char *buf, int *len, const char *name, const char *help, size_t offset) {
+    unsigned long total = 0;
+    for (int i = 0; i < num_shards; i++) {
+        total += __atomic_load_n((unsigned long *) ((char *) &shards[i] + offset), __ATOMIC_RELAXED);
+    }
+    append(buf, len, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, total);
+}
+
+// One histogram summed over the shards, as a Prometheus summary in seconds.
+void append_summary(char *buf, int *len, const char *name, const char *help, size_t offset) {
+    static Histogram h; // Only the metrics thread gets here
+    memset(&h, 0, sizeof(h));
+    for (int i = 0; i < num_shards; i++) {
+        Histogram *from = (Histogram *) ((char *) &shards[i] + offset);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            h.bucket[b] += __atomic_load_n(&from->bucket[b], __ATOMIC_RELAXED);
         }
-        
-        ClientNode *prev = front;
-        ClientNode *curr = front->next;
-        while (curr->next != NULL) {
-            if (curr->client.fd == fd) {
-                //Client to be deleted.
-                free(curr->client.name);
-                free(curr);
-                prev->next = curr->next;
-                return;
-            }
-            else {
-                curr = curr->next;
+        h.count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+        h.sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    }
+
+    append(buf, len, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+    unsigned long seen = 0;
+    int b = 0;
+    for (int q = 0; q < 4; q++) {
+        // Buckets were counted one shard at a time, so they may add up to a little more than count
+        unsigned long want = (unsigned long) (quantiles[q] * h.count + 0.5);
+        while (b < HIST_BUCKETS - 1 && (seen + h.bucket[b] < want || seen + h.bucket[b] == 0)) {
+            seen += h.bucket[b++];
+        }
+        double value = h.count == 0 ? 0 : bucket_top(b) / 1e6;
+        append(buf, len, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[q], value);
+    }
+    append(buf, len, "%s_sum %.6f\n%s_count %lu\n", name, h.sum / 1e6, name, h.count);
+}
+
+// Everything the shards have counted, in Prometheus text format.
+int render_metrics(char *buf) {
+    int len = 0;
+
+    long clients[3] = {0, 0, 0};
+    for (int i = 0; i < num_shards; i++) {
+        for (int state = 0; state < 3; state++) {
+            clients[state] += __atomic_load_n(&shards[i].clients_in[state], __ATOMIC_RELAXED);
+        }
+    }
+    append(buf, &len, "# HELP battle_clients Connected clients, by state.\n# TYPE battle_clients gauge\n");
+    append(buf, &len, "battle_clients{state=\"naming\"} %ld\n", clients[NAMING]);
+    append(buf, &len, "battle_clients{state=\"waiting\"} %ld\n", clients[WAITING]);
+    append(buf, &len, "battle_clients{state=\"battling\"} %ld\n", clients[BATTLING]);
+    append(buf, &len, "# HELP battle_shards Reactor threads.\n# TYPE battle_shards gauge\nbattle_shards %d\n",
+           num_shards);
+
+    append_counter(buf, &len, "battle_connections_total", "Connections accepted.",
+                   offsetof(Shard, connections));
+    append_counter(buf, &len, "battle_battles_total", "Battles started.",
+                   offsetof(Shard, battles_started));
+    append_counter(buf, &len, "battle_handoffs_total", "Clients moved to another shard to fight.",
+                   offsetof(Shard, handoffs));
+    append_counter(buf, &len, "battle_turns_total", "Turns shown to attackers.",
+                   offsetof(Shard, turns));
+    append_counter(buf, &len, "battle_received_bytes_total", "Bytes read from clients.",
+                   offsetof(Shard, bytes_in));
+    append_counter(buf, &len, "battle_sent_bytes_total", "Bytes sent to clients.",
+                   offsetof(Shard, bytes_out));
+    append_counter(buf, &len, "battle_send_calls_total", "send calls made.",
+                   offsetof(Shard, sends));
+
+    append_summary(buf, &len, "battle_match_wait_seconds",
+                   "Time from starting to wait for an opponent to the battle starting.",
+                   offsetof(Shard, match_wait));
+    append_summary(buf, &len, "battle_turn_latency_seconds",
+                   "Time from the server picking up a move to its answer being sent.",
+                   offsetof(Shard, turn_latency));
+    return len;
+}
+
+/*
+ * The metrics thread: answers every connection to ADMIN_PORT on localhost with the current
+ * metrics, as HTTP so Prometheus can scrape it (nc works too). It only ever reads the shards'
+ * counters, so the shards never wait for it.
+ */
+void *serve_metrics(void *arg) {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1) {
+        perror("metrics: socket");
+        return NULL;
+    }
+    int yes = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    struct sockaddr_in admin;
+    memset(&admin, 0, sizeof(admin));
+    admin.sin_family = AF_INET;
+    admin.sin_port = htons(ADMIN_PORT);
+    admin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *) &admin, sizeof(admin)) == -1 || listen(listenfd, 16) == -1) {
+        perror("metrics: bind");
+        close(listenfd);
+        return NULL;
+    }
+
+    static char body[METRICS_BUF];
+    char header[128];
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        // Whatever the request was, the answer is the same
+        struct timeval patience = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &patience, sizeof(patience));
+        char request[1024];
+        if (recv(fd, request, sizeof(request), 0) < 0) {
+            // Nothing asked (plain nc): answer anyway
+        }
+
+        int len = render_metrics(body);
+        int header_len = sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %d\r\n\r\n", len);
+        if (send(fd, header, header_len, MSG_NOSIGNAL) == -1 || send(fd, body, len, MSG_NOSIGNAL) == -1) {
+            perror("metrics: send");
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+#ifdef MATCH_BENCH
+/*
+ * make matchbench: what it costs to find a newcomer an opponent with n clients around, on
+ * the board, against walking the whole client list the way matchmaking used to. Half the
+ * newcomers last fought whoever is at the front of the board, so they have to skip one.
+ */
+double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    printf("%10s %14s %14s\n", "clients", "board ns/pair", "scan ns/pair");
+    for (int n = 1000; n <= 1000000; n *= 10) {
+        ClientNode *nodes = calloc(n + 1, sizeof(ClientNode));
+        for (int i = 0; i <= n; i++) {
+            nodes[i].client.id = i + 1;
+        }
+
+        // The board: n waiting; each pairing takes one off and puts the newcomer on the back
+        board.head = board.tail = NULL;
+        for (int i = 0; i < n; i++) {
+            queue_push(&board, &nodes[i].client);
+        }
+        int pairs = 1000000;
+        Client *newcomer = &nodes[n].client;
+        double start = seconds();
+        for (int i = 0; i < pairs; i++) {
+            newcomer->last_opponent = i % 2 ? board.head->id : 0;
+            Client *opponent = find_opponent(newcomer);
+            queue_remove(&board, opponent);
+            queue_push(&board, newcomer);
+            newcomer = opponent; // Its record comes back as the next newcomer
+        }
+        double board_ns = (seconds() - start) / pairs * 1e9;
+
+        // The old scan: n connected, only the last two waiting, walked from the front
+        for (int i = 0; i < n; i++) {
+            nodes[i].client.last_opponent = 0;
+            nodes[i].next = &nodes[i + 1];
+            nodes[i].client.state = i >= n - 2 ? WAITING : BATTLING;
+        }
+        nodes[n - 1].next = NULL;
+        int scans = n >= 100000 ? 100 : 100000000 / n / 10;
+        volatile long found = 0;
+        start = seconds();
+        for (int i = 0; i < scans; i++) {
+            for (ClientNode *a = nodes; a != NULL; a = a->next) {
+                if (a->client.state != WAITING) {
+                    continue;
+                }
+                for (ClientNode *b = a->next; b != NULL; b = b->next) {
+                    if (b->client.state == WAITING && can_fight(&a->client, &b->client)) {
+                        found++;
+                        break;
+                    }
+                }
+                break;
             }
         }
-        // client to be deleted is the last one in the list.
-        free(curr);
-        prev->next = NULL;
+        double scan_ns = (seconds() - start) / scans * 1e9;
+
+        printf("%10d %14.1f %14.1f\n", n, board_ns, scan_ns);
+        free(nodes);
     }
-    return;
-}
\ No newline at end of file
+    return 0;
+}
+#endif
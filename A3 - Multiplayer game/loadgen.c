@@ -0,0 +1,398 @@
+/*
+Load generator for the battle server.
+
+Opens a crowd of bot connections at once, has each one answer the name prompt and then
+play whenever the server shows it the attack menu, and reports how fast the server took
+the connections, how many turns went through per second, and how long the server took
+to answer a move (p50/p99/p99.9).
+
+Usage: loadgen [-h host] [-p port] [-c connections] [-d seconds] [-t think_ms] [-m moves] [-b]
+
+  -c   bots to connect (1000)
+  -d   how long to play once everyone is connected, in seconds (10)
+  -t   how long a bot thinks before answering the menu, in ms (0: right away)
+  -m   moves to pick from at random, any of a, p, r and s ("aprs")
+  -b   speak the binary protocol instead of text
+
+A turn's latency is the time from a bot sending its move to the first bytes of the
+server's answer arriving.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef PORT
+#define PORT 57230
+#endif
+
+#define MAX_EVENTS 256
+#define IN_BUF 4096
+
+// Latency histogram: exact below 32, then 16 buckets per power of two, so any value is within about 6%
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS 1024
+
+// Where a bot is
+#define CONNECTING 0 // Waiting for the name prompt
+#define NAMED 1 // Got the welcome, playing
+#define DEAD 2 // The server hung up
+
+// The binary protocol's frames we use (see battle.c)
+#define BINARY_VERSION 1
+#define F_NAME 0x01
+#define F_MOVE 0x02
+#define F_SPEAK 0x03
+#define F_WELCOME 0x81
+#define F_TURN 0x85
+#define F_SPEAKING 0x89
+
+typedef struct bot {
+    int fd;
+    int state;
+    int framed; // Past the name prompt in binary mode: everything is frames now
+    char in[IN_BUF]; // What came in, up to the end of the last whole line (or frame)
+    int in_len;
+    long long sent_at; // When the bot sent a move still waiting for an answer (us), 0 if none
+    long long due; // When the bot answers the menu it was shown (us), 0 if not shown one
+    struct bot *next_due; // Bots thinking, in order of due
+} Bot;
+
+long long hist[HIST_BUCKETS];
+long long turns = 0;
+long long max_latency = 0;
+int errors = 0; // Bots the server hung up on
+int unwelcomed = 0; // Of those, bots dropped before their welcome
+int binary = 0;
+
+// Bots waiting to answer. Everyone thinks for the same time, so this is just a FIFO.
+Bot *thinking = NULL;
+Bot *thinking_tail = NULL;
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int bucket_of(long long v) {
+    if (v < SUB_COUNT) {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1); // Leaves v >> shift in [16, 31]
+    return shift * (SUB_COUNT / 2) + (int) (v >> shift);
+}
+
+// The largest value that falls in bucket b.
+long long bucket_top(int b) {
+    if (b < SUB_COUNT) {
+        return b;
+    }
+    int shift = b / (SUB_COUNT / 2) - 1;
+    long long m = b % (SUB_COUNT / 2) + SUB_COUNT / 2;
+    return ((m + 1) << shift) - 1;
+}
+
+long long percentile(double p) {
+    long long want = (long long) (p * turns + 0.5);
+    long long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want && seen > 0) {
+            long long top = bucket_top(b);
+            return top < max_latency ? top : max_latency;
+        }
+    }
+    return max_latency;
+}
+
+void send_line(Bot *bot, const char *line) {
+    if (send(bot->fd, line, strlen(line), MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+        perror("send");
+    }
+}
+
+// Send a frame of the given type with a text payload.
+void send_frame(Bot *bot, int type, const char *payload) {
+    char frame[IN_BUF];
+    int len = strlen(payload);
+    frame[0] = (len + 1) >> 8;
+    frame[1] = (len + 1) & 0xff;
+    frame[2] = type;
+    memcpy(frame + 3, payload, len);
+    if (send(bot->fd, frame, 3 + len, MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+        perror("send");
+    }
+}
+
+// Answer the menu: one of the moves, chosen at random.
+void play(Bot *bot, const char *moves) {
+    char line[4] = {moves[rand() % strlen(moves)], '\r', '\n', '\0'};
+    bot->due = 0;
+    bot->sent_at = now_us();
+    if (binary) {
+        line[1] = '\0';
+        send_frame(bot, F_MOVE, line);
+    } else {
+        send_line(bot, line);
+    }
+}
+
+// The bot was shown the attack menu: answer now, or after thinking about it.
+void menu_shown(Bot *bot, long long think_us, const char *moves) {
+    if (think_us == 0) {
+        play(bot, moves);
+        return;
+    }
+    bot->due = now_us() + think_us;
+    bot->next_due = NULL;
+    if (thinking == NULL) {
+        thinking = bot;
+    } else {
+        thinking_tail->next_due = bot;
+    }
+    thinking_tail = bot;
+}
+
+// A whole line came from the server.
+void line_received(Bot *bot, int id, const char *line, long long think_us, const char *moves,
+                   int *named) {
+    char buf[64];
+    if (strcmp(line, "What is your name?") == 0 && binary) {
+        char hello[2] = {0, BINARY_VERSION};
+        send(bot->fd, hello, 2, MSG_NOSIGNAL);
+        sprintf(buf, "bot%d", id);
+        send_frame(bot, F_NAME, buf);
+        bot->framed = 1;
+    } else if (strcmp(line, "What is your name?") == 0) {
+        sprintf(buf, "bot%d\r\n", id);
+        send_line(bot, buf);
+    } else if (bot->state == CONNECTING && strncmp(line, "Welcome ", 8) == 0) {
+        bot->state = NAMED;
+        (*named)++;
+    } else if (strcmp(line, "(r)andom choice between regular attack or powermove") == 0) {
+        menu_shown(bot, think_us, moves);
+    } else if (strcmp(line, "Speak:") == 0) {
+        send_line(bot, "good game\r\n");
+    }
+}
+
+// A whole frame came from the server.
+void frame_received(Bot *bot, int type, const unsigned char *payload, long long think_us,
+                    const char *moves, int *named) {
+    if (type == F_WELCOME && bot->state == CONNECTING) {
+        bot->state = NAMED;
+        (*named)++;
+    } else if (type == F_TURN && payload[0] == 1) {
+        menu_shown(bot, think_us, moves);
+    } else if (type == F_SPEAKING && payload[0] == 1) {
+        send_frame(bot, F_SPEAK, "good game");
+    }
+}
+
+/*
+ * Take in what the server sent. The first bytes after a move are its answer, which is what
+ * the latency is measured to. Returns -1 if the server hung up.
+ */
+int read_bot(Bot *bot, int id, long long think_us, const char *moves, int *named) {
+    while (1) {
+        ssize_t n = recv(bot->fd, bot->in + bot->in_len, IN_BUF - 1 - bot->in_len, 0);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        if (bot->sent_at != 0) {
+            long long latency = now_us() - bot->sent_at;
+            bot->sent_at = 0;
+            hist[bucket_of(latency)]++;
+            turns++;
+            if (latency > max_latency) {
+                max_latency = latency;
+            }
+        }
+
+        bot->in_len += n;
+        char *start = bot->in;
+        char *end = bot->in + bot->in_len;
+        char *newline;
+        while (!bot->framed && (newline = memchr(start, '\n', end - start)) != NULL) {
+            *newline = '\0';
+            if (newline > start && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+            line_received(bot, id, start, think_us, moves, named);
+            start = newline + 1;
+        }
+        while (bot->framed && end - start >= 2) {
+            unsigned char *frame = (unsigned char *) start;
+            int len = frame[0] << 8 | frame[1];
+            if (end - start < 2 + len) {
+                break;
+            }
+            if (len > 0) {
+                frame_received(bot, frame[2], frame + 3, think_us, moves, named);
+            }
+            start += 2 + len;
+        }
+        bot->in_len = end - start;
+        if (bot->in_len == IN_BUF - 1) {
+            bot->in_len = 0; // A line that long is nothing a bot needs
+        }
+        memmove(bot->in, start, bot->in_len);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = PORT;
+    int count = 1000;
+    double seconds = 10;
+    long long think_us = 0;
+    const char *moves = "aprs";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:t:m:b")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': count = atoi(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 't': think_us = (long long) (atof(optarg) * 1000); break;
+        case 'm': moves = optarg; break;
+        case 'b': binary = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-d seconds] "
+                    "[-t think_ms] [-m moves] [-b]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (count < 1 || moves[0] == '\0' || strspn(moves, "aprs") != strlen(moves)) {
+        fprintf(stderr, "%s: need at least one connection, and moves from a, p, r and s\n", argv[0]);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every bot is a socket; take all the fds we're allowed
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "%s: not an IPv4 address: %s\n", argv[0], host);
+        exit(1);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    Bot *bots = calloc(count, sizeof(Bot));
+    if (epoll_fd == -1 || bots == NULL) {
+        perror("loadgen");
+        exit(1);
+    }
+
+    // Everyone connects at once
+    long long start = now_us();
+    for (int i = 0; i < count; i++) {
+        Bot *bot = &bots[i];
+        bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (bot->fd == -1) {
+            perror("socket");
+            exit(1);
+        }
+        fcntl(bot->fd, F_SETFL, fcntl(bot->fd, F_GETFL) | O_NONBLOCK);
+        int yes = 1;
+        setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)); // Moves go out as typed
+        if (connect(bot->fd, (struct sockaddr *) &server, sizeof(server)) == -1
+            && errno != EINPROGRESS) {
+            perror("connect");
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->fd, &ev);
+    }
+
+    int named = 0;
+    long long connected_at = 0; // When the last bot got its welcome
+    long long stop_at = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (stop_at == 0 || now_us() < stop_at) {
+        // Wake for the next bot done thinking, if that comes first
+        int timeout = 100;
+        if (thinking != NULL) {
+            long long wait = thinking->due - now_us();
+            timeout = wait <= 0 ? 0 : (int) ((wait + 999) / 1000);
+        }
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int id = events[i].data.u32;
+            Bot *bot = &bots[id];
+            if (read_bot(bot, id, think_us, moves, &named) == -1) {
+                unwelcomed += bot->state == CONNECTING;
+                bot->state = DEAD;
+                errors++;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bot->fd, NULL);
+                close(bot->fd);
+            }
+        }
+
+        long long now = now_us();
+        while (thinking != NULL && thinking->due <= now) {
+            Bot *bot = thinking;
+            thinking = bot->next_due;
+            if (thinking == NULL) {
+                thinking_tail = NULL;
+            }
+            if (bot->state != DEAD) {
+                play(bot, moves);
+            }
+        }
+
+        if (stop_at == 0 && named + unwelcomed == count) {
+            // Everyone's in: from here on, count only the playing
+            connected_at = now;
+            stop_at = now + (long long) (seconds * 1e6);
+            turns = 0;
+            max_latency = 0;
+            memset(hist, 0, sizeof(hist));
+        }
+        if (unwelcomed == count) {
+            fprintf(stderr, "%s: every connection failed\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    double connect_seconds = (connected_at - start) / 1e6;
+    printf("connections: %d in %.2f s (%.0f/s)\n", count, connect_seconds, count / connect_seconds);
+    printf("turns: %lld in %.2f s (%.0f/s)\n", turns, seconds, turns / seconds);
+    printf("turn latency (us): p50 %lld  p99 %lld  p99.9 %lld  max %lld\n",
+           percentile(0.50), percentile(0.99), percentile(0.999), max_latency);
+    printf("disconnected by server: %d\n", errors);
+    return 0;
+}